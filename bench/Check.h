@@ -0,0 +1,38 @@
+//
+//  Check.h
+//  LabExcelsior
+//
+//  A minimal harness for the test programs alongside the benchmarks. Each
+//  program runs its tests from main and returns CheckResult(), which is
+//  nonzero if any check failed.
+//
+
+#ifndef Check_h
+#define Check_h
+
+#include <stdio.h>
+
+inline int& CheckFailures()
+{
+    static int failures = 0;
+    return failures;
+}
+
+#define CHECK(x) \
+    do { \
+        if (!(x)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #x); \
+            ++CheckFailures(); \
+        } \
+    } while (0)
+
+inline int CheckResult(const char* name)
+{
+    if (CheckFailures())
+        fprintf(stderr, "%s: %d checks failed\n", name, CheckFailures());
+    else
+        printf("%s: ok\n", name);
+    return CheckFailures() ? 1 : 0;
+}
+
+#endif /* Check_h */
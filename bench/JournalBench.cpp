@@ -0,0 +1,83 @@
+//
+//  JournalBench.cpp
+//  LabExcelsior
+//
+//  Throughput of Journal truncation on deep chains and wide forks.
+//
+//  c++ -std=c++17 -O2 -DHAVE_NO_USD -Isrc -I<concurrentqueue> src/Modes.cpp bench/JournalBench.cpp
+//
+
+#include "Modes.h"
+
+#include <chrono>
+#include <stdio.h>
+
+using namespace lab;
+using Clock = std::chrono::steady_clock;
+
+static void Report(const char* name, uint32_t nodes, Clock::time_point t0, Clock::time_point t1)
+{
+    double s = std::chrono::duration<double>(t1 - t0).count();
+    printf("%-28s %9u nodes %9.3f ms %8.1f Mnodes/s\n",
+           name, nodes, s * 1e3, nodes / s * 1e-6);
+}
+
+// a single linear history, truncated back to the root
+static void TruncateChain(uint32_t n)
+{
+    Journal j;
+    for (uint32_t i = 0; i < n; ++i)
+        j.Append(Transaction("Move", [](){}));
+
+    auto t0 = Clock::now();
+    j.Truncate(j.Root());
+    auto t1 = Clock::now();
+    Report("truncate chain", n, t0, t1);
+}
+
+// every level forks width ways, and the history continues from the last
+// fork, so the tree is both deep and wide
+static void TruncateForks(uint32_t n, uint32_t width)
+{
+    Journal j;
+    uint32_t made = 0;
+    while (made < n) {
+        j.Append(Transaction("Move", [](){}));
+        ++made;
+        for (uint32_t w = 1; w < width && made < n; ++w, ++made)
+            j.Fork(Transaction("Move", [](){}));
+    }
+
+    auto t0 = Clock::now();
+    j.Truncate(j.Root());
+    auto t1 = Clock::now();
+    char name[64];
+    snprintf(name, sizeof(name), "truncate forks x%u", width);
+    Report(name, n, t0, t1);
+}
+
+// truncation that immediately reuses the released nodes, as happens when a
+// user undoes to the start and carries on editing
+static void TruncateAndRefill(uint32_t n)
+{
+    Journal j;
+    for (uint32_t i = 0; i < n; ++i)
+        j.Append(Transaction("Move", [](){}));
+
+    auto t0 = Clock::now();
+    j.Truncate(j.Root());
+    for (uint32_t i = 0; i < n; ++i)
+        j.Append(Transaction("Move", [](){}));
+    auto t1 = Clock::now();
+    Report("truncate and refill", n, t0, t1);
+}
+
+int main()
+{
+    const uint32_t n = 1000000;
+    TruncateChain(n);
+    TruncateForks(n, 4);
+    TruncateForks(n, 64);
+    TruncateAndRefill(n);
+    return 0;
+}
@@ -0,0 +1,221 @@
+//
+//  JournalLogTest.cpp
+//  LabExcelsior
+//
+//  Regression tests for JournalLog: recovery rebuilds the tree as it stood
+//  when the log was last written, removals and evictions included.
+//
+//  c++ -std=c++17 -DHAVE_NO_USD -Isrc -Ibench -I<concurrentqueue> src/Modes.cpp src/JournalLog.cpp bench/JournalLogTest.cpp
+//
+
+#include "Modes.h"
+#include "JournalLog.h"
+#include "Check.h"
+
+#include <stdlib.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace lab;
+
+static bool Write(const Transaction& t, std::string& bytes)
+{
+    bytes = t.message.Str();
+    return true;
+}
+
+static bool Read(const char* bytes, size_t size, Transaction& t)
+{
+    t = Transaction(std::string(bytes, size), [](){});
+    return true;
+}
+
+// the tree below node, written as label(child,child...)
+static std::string Shape(const Journal& j, JournalIndex node)
+{
+    const JournalNode& n = j.Node(node);
+    std::string s = node == j.Root() ? "0" : n.transaction.message.Str();
+    if (n.next == kJournalNil)
+        return s;
+    s += "(";
+    for (JournalIndex c = n.next; c != kJournalNil; c = j.Node(c).sibling) {
+        if (c != n.next)
+            s += ",";
+        s += Shape(j, c);
+    }
+    return s + ")";
+}
+
+static std::string TempPath()
+{
+    char path[] = "/tmp/journallogXXXXXX";
+    int fd = mkstemp(path);
+    close(fd);
+    unlink(path);
+    return path;
+}
+
+template <typename F>
+static void Roundtrip(const char* expect, F&& edit)
+{
+    std::string path = TempPath();
+    std::string live;
+    {
+        Journal j;
+        JournalLog log(Write);
+        CHECK(log.Open(path));
+        j.SetSink(&log);
+        edit(j);
+        live = Shape(j, j.Root());
+        log.Flush();
+    }
+
+    Journal j;
+    JournalLog log(Write);
+    CHECK(log.Open(path));
+    JournalIndex last = log.Recover(j, Read);
+    CHECK(j.Validate());
+    CHECK(live == expect);
+    CHECK(Shape(j, j.Root()) == live);
+    CHECK(last != kJournalNil);
+    if (live != expect || Shape(j, j.Root()) != live)
+        fprintf(stderr, "  expected %s, live %s, recovered %s\n",
+                expect, live.c_str(), Shape(j, j.Root()).c_str());
+    unlink(path.c_str());
+}
+
+static void TestRemovedForkStaysRemoved()
+{
+    Roundtrip("0(1(2))", [](Journal& j) {
+        j.Append(Transaction("1", [](){}));
+        j.Append(Transaction("2", [](){}));
+        j.Fork(Transaction("3", [](){}));
+        j.Remove(j.Current());
+    });
+}
+
+static void TestTruncatedStaysTruncated()
+{
+    Roundtrip("0(1)", [](Journal& j) {
+        j.Append(Transaction("1", [](){}));
+        JournalIndex one = j.Current();
+        j.Append(Transaction("2", [](){}));
+        j.Fork(Transaction("3", [](){}));
+        j.Truncate(one);
+    });
+}
+
+static void TestEvictedStaysEvicted()
+{
+    // the budget first evicts the fork, then folds the oldest nodes into
+    // the root, which stands for the state after them
+    Roundtrip("0(5(6))", [](Journal& j) {
+        j.Append(Transaction("1", [](){}));
+        j.Append(Transaction("2", [](){}));
+        j.Fork(Transaction("f", [](){}));
+        j.Seek(j.Node(j.Current()).parent);
+        j.Append(Transaction("3", [](){}));
+        j.Append(Transaction("4", [](){}));
+        j.Append(Transaction("5", [](){}));
+        j.Append(Transaction("6", [](){}));
+        j.SetBudget(0, 3);
+    });
+}
+
+// recovering into a journal whose sink was already the log wrote the whole
+// history out again, duplicating it on every start
+static void TestRecoverDoesNotLogAgain()
+{
+    std::string path = TempPath();
+    int written = 0;
+    auto counting = [&written](const Transaction& t, std::string& bytes) {
+        ++written;
+        return Write(t, bytes);
+    };
+    {
+        Journal j;
+        JournalLog log(counting);
+        CHECK(log.Open(path));
+        j.SetSink(&log);
+        j.Append(Transaction("1", [](){}));
+        j.Fork(Transaction("2", [](){}));
+        log.Flush();
+    }
+    CHECK(written == 2);
+
+    Journal j;
+    JournalLog log(counting);
+    CHECK(log.Open(path));
+    j.SetSink(&log);
+    log.Recover(j, Read);
+    log.Flush();
+    CHECK(written == 2);
+    CHECK(j.Sink() == &log);
+    CHECK(Shape(j, j.Root()) == "0(1,2)");
+    unlink(path.c_str());
+}
+
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define LAB_SANITIZED 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer)
+#define LAB_SANITIZED 1
+#endif
+#endif
+
+// the mapping is grown by remapping, and a failed remap used to leave the
+// log spinning forever on the next record. The test limits the address
+// space so that the remap fails, in a child process so the limit does not
+// outlive it; sanitizers reserve too much address space for that to work.
+static void TestRemapFailureStopsLogging()
+{
+#ifndef LAB_SANITIZED
+    std::string path = TempPath();
+    pid_t pid = fork();
+    if (pid == 0) {
+        alarm(10);
+        const size_t payload = 8 << 20;
+        std::string big(payload, 'x');
+        JournalLog log([&big](const Transaction& t, std::string& bytes) {
+            bytes = t.message.Str() == "big" ? big : "small";
+            return true;
+        });
+        if (!log.Open(path))
+            _exit(2);
+        Journal j;
+        j.SetSink(&log);
+
+        // room for staging the record, but not for a mapping twice its size
+        long pages = 0;
+        FILE* f = fopen("/proc/self/statm", "r");
+        if (!f || fscanf(f, "%ld", &pages) != 1)
+            _exit(3);
+        fclose(f);
+        struct rlimit limit;
+        limit.rlim_cur = limit.rlim_max = pages * sysconf(_SC_PAGESIZE) + 3 * payload;
+        setrlimit(RLIMIT_AS, &limit);
+
+        j.Append(Transaction("big", [](){}));
+        log.Flush();
+        j.Append(Transaction("after", [](){}));
+        log.Flush();
+        _exit(log.Failed() ? 0 : 4);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    unlink(path.c_str());
+#endif
+}
+
+int main()
+{
+    TestRemovedForkStaysRemoved();
+    TestTruncatedStaysTruncated();
+    TestEvictedStaysEvicted();
+    TestRecoverDoesNotLogAgain();
+    TestRemapFailureStopsLogging();
+    return CheckResult("JournalLogTest");
+}
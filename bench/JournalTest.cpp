@@ -0,0 +1,200 @@
+//
+//  JournalTest.cpp
+//  LabExcelsior
+//
+//  Regression tests for Journal: the branch table stays consistent with
+//  the tree through appends, forks, removal, truncation, navigation, and
+//  eviction, checked on fixed cases and on random sequences of operations.
+//
+//  c++ -std=c++17 -DHAVE_NO_USD -Isrc -Ibench -I<concurrentqueue> src/Modes.cpp bench/JournalTest.cpp
+//
+
+#include "Modes.h"
+#include "Check.h"
+
+#include <algorithm>
+#include <unordered_set>
+#include <vector>
+
+using namespace lab;
+
+static std::vector<JournalIndex> LiveNodes(const Journal& j)
+{
+    std::vector<JournalIndex> live;
+    std::vector<JournalIndex> work = { j.Root() };
+    while (!work.empty()) {
+        JournalIndex i = work.back();
+        work.pop_back();
+        live.push_back(i);
+        for (JournalIndex c = j.Node(i).next; c != kJournalNil; c = j.Node(c).sibling)
+            work.push_back(c);
+    }
+    return live;
+}
+
+// every live branch has live head and tip, the tip descends from the head
+// along the branch, forks are listed under their fork point, and every node
+// either heads its branch or continues its parent's
+static bool BranchTableConsistent(const Journal& j)
+{
+    std::vector<JournalIndex> nodes = LiveNodes(j);
+    std::unordered_set<JournalIndex> live(nodes.begin(), nodes.end());
+    bool ok = true;
+    uint32_t heads = 0;
+    j.ForEachBranch([&](JournalBranchId id, const JournalBranch& b) {
+        ++heads;
+        if (!live.count(b.head) || !live.count(b.tip)) {
+            ok = false;
+            return;
+        }
+        JournalIndex i = b.tip;
+        while (i != b.head && i != kJournalNil) {
+            if (j.BranchOf(i) != id)
+                ok = false;
+            i = j.Node(i).parent;
+        }
+        if (i != b.head || j.BranchOf(b.head) != id)
+            ok = false;
+        if (b.head == j.Root()) {
+            ok = ok && b.fork_point == kJournalNil;
+            return;
+        }
+        if (b.fork_point != j.Node(b.head).parent || !live.count(b.fork_point)) {
+            ok = false;
+            return;
+        }
+        const auto& forks = j.Branches(b.fork_point);
+        if (j.BranchOf(b.fork_point) != id &&
+            std::find(forks.begin(), forks.end(), id) == forks.end())
+            ok = false;
+    });
+    for (JournalIndex i : nodes) {
+        const JournalBranch& b = j.Branch(j.BranchOf(i));
+        if (b.head == kJournalNil)
+            ok = false;
+        else if (b.head != i && j.BranchOf(j.Node(i).parent) != j.BranchOf(i))
+            ok = false;
+        for (JournalBranchId id : j.Branches(i))
+            if (j.Branch(id).fork_point != i)
+                ok = false;
+    }
+    return ok && heads > 0;
+}
+
+// the root absorbing oldest used to leave branch zero's tip on the freed
+// node, and the fork from oldest keyed under the freed index
+static void TestEvictOldestKeepsForks()
+{
+    Journal j;
+    j.Append(Transaction("A", [](){}));
+    j.Append(Transaction("B", [](){}));
+    j.Fork(Transaction("F", [](){}));
+    JournalIndex f = j.Current();
+    j.Append(Transaction("G", [](){}));
+    j.SetBudget(0, 3);
+    CHECK(j.Validate());
+    CHECK(BranchTableConsistent(j));
+    CHECK(j.Node(f).parent == j.Root());
+    CHECK(j.Branches(j.Root()).size() == 1);
+
+    // lift the budget, so the rest of the history stays put
+    j.SetBudget(0, 0);
+    j.Append(Transaction("H", [](){}));
+    j.Fork(Transaction("I", [](){}));
+    CHECK(BranchTableConsistent(j));
+
+    j.Remove(f);
+    CHECK(j.Validate());
+    CHECK(BranchTableConsistent(j));
+    j.SwitchToBranch(0);
+    CHECK(j.Current() == j.Root());
+}
+
+// the published counts agree with the tree and the branch table
+static bool StatsAgree(const Journal& j)
+{
+    uint32_t branches = 0, leaves = 0;
+    j.ForEachBranch([&branches](JournalBranchId, const JournalBranch&) { ++branches; });
+    for (JournalIndex i : LiveNodes(j))
+        leaves += j.Node(i).next == kJournalNil;
+    JournalStats s = j.Stats();
+    return s.branches == branches && s.leaves == leaves;
+}
+
+// the branches stat counted leaves, which a branch whose tip has only forked
+// children is not
+static void TestBranchesAreCountedFromTheTable()
+{
+    Journal j;
+    j.Append(Transaction("A", [](){}));
+    j.Append(Transaction("B", [](){}));
+    JournalIndex b = j.Current();
+    j.Fork(Transaction("F", [](){}));
+    j.Remove(b);
+    CHECK(j.Validate());
+    CHECK(BranchTableConsistent(j));
+    CHECK(j.Stats().branches == 2);
+    CHECK(j.Stats().leaves == 1);
+    CHECK(StatsAgree(j));
+}
+
+static uint32_t Next(uint64_t& state)
+{
+    state = state * 6364136223846793005ull + 1442695040888963407ull;
+    return static_cast<uint32_t>(state >> 33);
+}
+
+// returns the step that broke the journal, or zero
+static uint32_t Fuzz(uint64_t seed, uint32_t steps)
+{
+    Journal j;
+    uint64_t state = seed;
+    for (uint32_t step = 1; step <= steps; ++step) {
+        std::vector<JournalIndex> live = LiveNodes(j);
+        JournalIndex any = live[Next(state) % live.size()];
+        switch (Next(state) % 10) {
+            case 0:
+            case 1: j.Append(Transaction("a", [](){})); break;
+            case 2: j.Fork(Transaction("f", [](){})); break;
+            case 3: j.Undo(1 + Next(state) % 3); break;
+            case 4: j.Redo(1 + Next(state) % 3); break;
+            case 5: j.Remove(any); break;
+            case 6: j.JumpTo(any); break;
+            case 7: j.Truncate(any); break;
+            case 8: {
+                std::vector<JournalBranchId> ids;
+                j.ForEachBranch([&ids](JournalBranchId id, const JournalBranch&) { ids.push_back(id); });
+                j.SwitchToBranch(ids[Next(state) % ids.size()]);
+                break;
+            }
+            case 9: {
+                uint32_t nodes = Next(state) % 4 ? 3 + Next(state) % 16 : 0;
+                j.SetBudget(0, nodes);
+                break;
+            }
+        }
+        if (!j.Validate() || !BranchTableConsistent(j) || !StatsAgree(j))
+            return step;
+    }
+    return 0;
+}
+
+static void TestFuzz()
+{
+    for (uint64_t seed = 1; seed <= 500; ++seed) {
+        uint32_t step = Fuzz(seed, 300);
+        if (step)
+            fprintf(stderr, "  seed %llu broke at step %u\n", (unsigned long long) seed, step);
+        CHECK(step == 0);
+        if (step)
+            break;
+    }
+}
+
+int main()
+{
+    TestEvictOldestKeepsForks();
+    TestBranchesAreCountedFromTheTable();
+    TestFuzz();
+    return CheckResult("JournalTest");
+}
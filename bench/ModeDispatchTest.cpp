@@ -0,0 +1,110 @@
+//
+//  ModeDispatchTest.cpp
+//  LabExcelsior
+//
+//  Regression tests for the ModeManager's dispatch tables: an activity's
+//  callback that activates or deactivates activities changes the tables the
+//  dispatch is iterating.
+//
+//  c++ -std=c++17 -DHAVE_NO_USD -Isrc -Ibench -I<concurrentqueue> src/Modes.cpp bench/ModeDispatchTest.cpp
+//
+
+#include "Modes.h"
+#include "Check.h"
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace lab;
+
+// counts its callbacks, and calls back into the test from them
+template <int N>
+class Counted : public Activity
+{
+public:
+    int ui = 0, updates = 0;
+    std::function<void()> on_ui, on_update;
+
+    Counted() {
+        activity.RunUI = [](void* self, const LabViewInteraction*) {
+            auto a = static_cast<Counted*>(self);
+            ++a->ui;
+            if (a->on_ui)
+                a->on_ui();
+        };
+        activity.Update = [](void* self) {
+            auto a = static_cast<Counted*>(self);
+            ++a->updates;
+            if (a->on_update)
+                a->on_update();
+        };
+    }
+    static std::string sname() { return "Counted" + std::to_string(N); }
+    const std::string Name() const override { return sname(); }
+};
+
+// enough activities to reallocate the tables when they join
+template <int... N>
+static std::vector<ActivityHandle> RegisterMany(ModeManager& mm, std::integer_sequence<int, N...>)
+{
+    return { mm.RegisterActivity<Counted<N + 2>>([]() { return std::make_shared<Counted<N + 2>>(); })... };
+}
+
+template <int N>
+static Counted<N>& Find(ModeManager& mm, ActivityHandle h)
+{
+    return static_cast<Counted<N>&>(*mm.FindActivity(h));
+}
+
+// the batch calls patched the tables at once, so a callback that made them
+// freed the table its own dispatch was walking
+static void TestActivationFromCallbacks()
+{
+    ModeManager mm;
+    ActivityHandle a = mm.RegisterActivity<Counted<0>>([]() { return std::make_shared<Counted<0>>(); });
+    ActivityHandle b = mm.RegisterActivity<Counted<1>>([]() { return std::make_shared<Counted<1>>(); });
+    std::vector<ActivityHandle> more = RegisterMany(mm, std::make_integer_sequence<int, 64>());
+    mm.ActivateActivities({ a, b });
+
+    // the first activity activates the rest and deactivates the second,
+    // which still runs for the dispatch under way
+    Find<0>(mm, a).on_ui = [&]() {
+        if (Find<0>(mm, a).ui == 1) {
+            mm.ActivateActivities(more.data(), more.size());
+            mm.DeactivateActivities({ b });
+        }
+    };
+    LabViewInteraction vi;
+    mm.RunModeUIs(vi);
+    CHECK(Find<1>(mm, b).ui == 1);
+    CHECK(Find<2>(mm, more[0]).ui == 0);
+    mm.RunModeUIs(vi);
+    CHECK(Find<0>(mm, a).ui == 2);
+    CHECK(Find<1>(mm, b).ui == 1);
+    CHECK(Find<2>(mm, more[0]).ui == 1);
+    CHECK(Find<65>(mm, more.back()).ui == 1);
+
+    // the same from an update
+    Find<0>(mm, a).on_update = [&]() {
+        if (Find<0>(mm, a).updates == 1) {
+            mm.DeactivateActivities(more.data(), more.size());
+            mm.ActivateActivities({ b });
+        }
+    };
+    mm.UpdateTransactionQueueActivationAndModes();
+    CHECK(Find<1>(mm, b).updates == 0);
+    CHECK(Find<2>(mm, more[0]).updates == 1);
+    mm.UpdateTransactionQueueActivationAndModes();
+    CHECK(Find<0>(mm, a).updates == 2);
+    CHECK(Find<1>(mm, b).updates == 1);
+    CHECK(Find<2>(mm, more[0]).updates == 1);
+}
+
+int main()
+{
+    TestActivationFromCallbacks();
+    return CheckResult("ModeDispatchTest");
+}
@@ -0,0 +1,157 @@
+//
+//  ModeRegistryTest.cpp
+//  LabExcelsior
+//
+//  Regression tests for the ModeManager's registry: a factory, or an
+//  activation, that registers further activities and modes grows the
+//  registry under the lookup that called it.
+//
+//  c++ -std=c++17 -DHAVE_NO_USD -Isrc -Ibench -I<concurrentqueue> src/Modes.cpp bench/ModeRegistryTest.cpp
+//
+
+#include "Modes.h"
+#include "Check.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+
+using namespace lab;
+
+template <int N>
+class Numbered : public Activity
+{
+public:
+    static std::string sname() { return "Numbered" + std::to_string(N); }
+    const std::string Name() const override { return sname(); }
+};
+
+template <int N>
+class NumberedMode : public MajorMode
+{
+    std::vector<std::string> _config;
+public:
+    static std::string sname() { return "NumberedMode" + std::to_string(N); }
+    const std::string Name() const override { return sname(); }
+    const std::vector<std::string>& ModeConfiguration() const override { return _config; }
+};
+
+// enough registrations to reallocate the registry's vectors
+template <int... N>
+static void RegisterMany(ModeManager& mm, std::integer_sequence<int, N...>)
+{
+    (mm.RegisterActivity<Numbered<N>>([]() { return std::make_shared<Numbered<N>>(); }), ...);
+    (mm.RegisterMajorMode<NumberedMode<N>>([]() { return std::make_shared<NumberedMode<N>>(); }), ...);
+}
+
+static void RegisterMany(ModeManager& mm)
+{
+    RegisterMany(mm, std::make_integer_sequence<int, 64>());
+}
+
+class Outer : public Activity
+{
+public:
+    static constexpr const char* sname() { return "Outer"; }
+    const std::string Name() const override { return sname(); }
+};
+
+class OuterMode : public MajorMode
+{
+    std::vector<std::string> _config = { "Outer" };
+public:
+    static constexpr const char* sname() { return "OuterMode"; }
+    const std::string Name() const override { return sname(); }
+    const std::vector<std::string>& ModeConfiguration() const override { return _config; }
+};
+
+// registers on activation rather than on creation
+class Registering : public Activity
+{
+    ModeManager& _mm;
+protected:
+    void _activate() override { RegisterMany(_mm); }
+public:
+    explicit Registering(ModeManager& mm) : _mm(mm) {}
+    static constexpr const char* sname() { return "Registering"; }
+    const std::string Name() const override { return sname(); }
+};
+
+// the factory used to be called through a reference into the factories,
+// and its result stored through a reference into the records, both of
+// which the registrations it made had freed
+static void TestFactoryThatRegistersActivities()
+{
+    ModeManager mm;
+    ActivityHandle h = mm.RegisterActivity<Outer>([&mm]() {
+        RegisterMany(mm);
+        return std::make_shared<Outer>();
+    });
+    uint64_t generation = mm.ActivitiesGeneration();
+    const std::shared_ptr<Activity>& a = mm.FindActivity(h);
+    CHECK(a && a->Name() == "Outer");
+    CHECK(mm.ActivityNames().size() == 65);
+    CHECK(mm.ActivitiesGeneration() > generation);
+    CHECK(mm.FindActivity("Outer") == mm.FindActivity(h));
+    CHECK(mm.FindActivity(mm.FindActivityHandle<Numbered<63>>()));
+}
+
+static void TestFactoryThatRegistersModes()
+{
+    ModeManager mm;
+    MajorModeHandle h = mm.RegisterMajorMode<OuterMode>([&mm]() {
+        RegisterMany(mm);
+        return std::make_shared<OuterMode>();
+    });
+    const std::shared_ptr<MajorMode>& m = mm.FindMode(h);
+    CHECK(m && m->Name() == "OuterMode");
+    CHECK(mm.MajorModeNames().size() == 65);
+    CHECK(mm.FindMode(mm.FindMajorModeHandle<NumberedMode<63>>()));
+}
+
+// a factory that looks up its own activity gets there first, and that
+// instance is the one kept
+static void TestReentrantFactory()
+{
+    ModeManager mm;
+    int made = 0;
+    ActivityHandle h;
+    h = mm.RegisterActivity<Outer>([&mm, &made, &h]() {
+        ++made;
+        if (made == 1)
+            mm.FindActivity(h);
+        return std::make_shared<Outer>();
+    });
+    const Activity* first = mm.FindActivity(h).get();
+    CHECK(first);
+    CHECK(made == 2);
+    CHECK(mm.FindActivity(h).get() == first);
+}
+
+static void TestActivationThatRegisters()
+{
+    ModeManager mm;
+    ActivityHandle h = mm.RegisterActivity<Registering>([&mm]() {
+        return std::make_shared<Registering>(mm);
+    });
+    mm.ActivateActivity(h);
+    CHECK(mm.FindActivity(h)->IsActive());
+    CHECK(mm.ActivityNames().size() == 65);
+
+    ModeManager other;
+    ActivityHandle g = other.RegisterActivity<Registering>([&other]() {
+        return std::make_shared<Registering>(other);
+    });
+    other.ActivateActivities({ g });
+    CHECK(other.FindActivity(g)->IsActive());
+    CHECK(other.ActivityNames().size() == 65);
+}
+
+int main()
+{
+    TestFactoryThatRegistersActivities();
+    TestFactoryThatRegistersModes();
+    TestReentrantFactory();
+    TestActivationThatRegisters();
+    return CheckResult("ModeRegistryTest");
+}
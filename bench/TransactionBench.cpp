@@ -0,0 +1,191 @@
+//
+//  TransactionBench.cpp
+//  LabExcelsior
+//
+//  Transactions per second through ModeManager::EnqueueTransaction and the
+//  frame's drain, comparing closures held in std::functions with closures
+//  held inline; enqueuing one at a time with enqueuing in batches through a
+//  TransactionProducer; and, on the bare queue, draining an item at a time
+//  with draining in bulk.
+//
+//  c++ -std=c++17 -O2 -DHAVE_NO_USD -Isrc -I<concurrentqueue> src/Modes.cpp bench/TransactionBench.cpp
+//
+
+#include "Modes.h"
+#include "concurrentqueue.hpp"
+
+#include <chrono>
+#include <iterator>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+using namespace lab;
+using Clock = std::chrono::steady_clock;
+
+// a capture about the size of a prim, a token, and a value, and a count of
+// the transactions run, so the frame thread knows when it is done
+struct Edit {
+    double value[3];
+    double* target;
+    int* executed;
+
+    void operator()() const { *target += value[0]; ++*executed; }
+};
+
+// the closures either stored inline in the transaction, or wrapped in
+// std::functions first, which is where they lived before InlineFunction
+static Transaction Make(bool inline_closures, const Edit& e, const Edit& u)
+{
+    if (inline_closures)
+        return Transaction("Move", e, u);
+    return Transaction("Move", std::function<void()>(e), std::function<void()>(u));
+}
+
+// the journal is given a node budget so that the history of millions of
+// transactions does not dominate the measurement
+static void Run(bool inline_closures, int producers, int per_producer)
+{
+    ModeManager mm;
+    mm.Journal().SetBudget(0, 1 << 16);
+    double sink = 0;
+    int executed = 0;
+
+    auto t0 = Clock::now();
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; ++p) {
+        threads.emplace_back([&mm, &sink, &executed, inline_closures, per_producer]() {
+            for (int i = 0; i < per_producer; ++i) {
+                Edit e = { { double(i), 0, 0 }, &sink, &executed };
+                Edit u = { { double(-i), 0, 0 }, &sink, &executed };
+                mm.EnqueueTransaction(Make(inline_closures, e, u));
+            }
+        });
+    }
+
+    // the frame thread runs frames while the producers run
+    const int total = producers * per_producer;
+    while (executed < total)
+        mm.UpdateTransactionQueueActivationAndModes();
+    for (auto& th : threads)
+        th.join();
+    auto t1 = Clock::now();
+
+    double s = std::chrono::duration<double>(t1 - t0).count();
+    printf("%-16s %2d producers %8d transactions %9.3f ms %8.2f Mtx/s\n",
+           inline_closures ? "InlineFunction" : "std::function",
+           producers, total, s * 1e3, total / s * 1e-6);
+}
+
+// producers burst into the queue while the frame thread drains it, either
+// with try_dequeue per item, or with try_dequeue_bulk into a reused buffer
+static void Drain(bool bulk, int producers, int per_producer)
+{
+    moodycamel::ConcurrentQueue<Transaction> queue;
+    moodycamel::ConsumerToken consumer(queue);
+    std::vector<Transaction> buffer(256);
+    double sink = 0;
+
+    auto t0 = Clock::now();
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; ++p) {
+        threads.emplace_back([&queue, &sink, per_producer]() {
+            for (int i = 0; i < per_producer; ++i)
+                queue.enqueue(Transaction("Move", [&sink, i]() { sink += i; }));
+        });
+    }
+
+    const int total = producers * per_producer;
+    int drained = 0;
+    if (bulk) {
+        while (drained < total) {
+            size_t got = queue.try_dequeue_bulk(consumer, buffer.begin(), buffer.size());
+            for (size_t i = 0; i < got; ++i)
+                buffer[i].exec();
+            drained += static_cast<int>(got);
+        }
+    }
+    else {
+        Transaction t;
+        while (drained < total) {
+            if (queue.try_dequeue(t)) {
+                t.exec();
+                ++drained;
+            }
+        }
+    }
+    for (auto& th : threads)
+        th.join();
+    auto t1 = Clock::now();
+
+    double s = std::chrono::duration<double>(t1 - t0).count();
+    printf("%-16s %2d producers %8d transactions %9.3f ms %8.2f Mtx/s\n",
+           bulk ? "bulk drain" : "per item drain", producers, total, s * 1e3, total / s * 1e-6);
+}
+
+// producers enqueue either one at a time through EnqueueTransaction, or in
+// batches of batch through a TransactionProducer each
+static void Produce(int batch, int producers, int per_producer)
+{
+    ModeManager mm;
+    mm.Journal().SetBudget(0, 1 << 16);
+    double sink = 0;
+    int executed = 0;
+
+    auto t0 = Clock::now();
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; ++p) {
+        threads.emplace_back([&mm, &sink, &executed, batch, per_producer]() {
+            if (!batch) {
+                for (int i = 0; i < per_producer; ++i)
+                    mm.EnqueueTransaction(Transaction("Move", Edit { { double(i), 0, 0 }, &sink, &executed }));
+                return;
+            }
+            TransactionProducer producer = mm.MakeTransactionProducer();
+            std::vector<Transaction> pending;
+            pending.reserve(batch);
+            for (int i = 0; i < per_producer; ++i) {
+                pending.emplace_back("Move", Edit { { double(i), 0, 0 }, &sink, &executed });
+                if (pending.size() == size_t(batch) || i == per_producer - 1) {
+                    producer.Enqueue(pending.data(), pending.size());
+                    pending.clear();
+                }
+            }
+        });
+    }
+
+    const int total = producers * per_producer;
+    while (executed < total)
+        mm.UpdateTransactionQueueActivationAndModes();
+    for (auto& th : threads)
+        th.join();
+    auto t1 = Clock::now();
+
+    char name[32];
+    if (batch)
+        snprintf(name, sizeof(name), "producer batch %d", batch);
+    else
+        snprintf(name, sizeof(name), "enqueue");
+    double s = std::chrono::duration<double>(t1 - t0).count();
+    printf("%-18s %2d producers %8d transactions %9.3f ms %8.2f Mtx/s\n",
+           name, producers, total, s * 1e3, total / s * 1e-6);
+}
+
+int main()
+{
+    const int total = 1 << 21;
+    for (int producers : { 1, 4, 16 }) {
+        Run(false, producers, total / producers);
+        Run(true, producers, total / producers);
+    }
+    for (int producers : { 1, 2, 4, 8, 16 }) {
+        Drain(false, producers, total / producers);
+        Drain(true, producers, total / producers);
+    }
+    for (int producers : { 1, 4, 16, 32 }) {
+        Produce(0, producers, total / producers);
+        Produce(1, producers, total / producers);
+        Produce(64, producers, total / producers);
+    }
+    return 0;
+}
@@ -0,0 +1,176 @@
+//
+//  TransactionCaptureTest.cpp
+//  LabExcelsior
+//
+//  Regression tests for TransactionCapture: a replayed capture enqueues each
+//  thread's transactions in their recorded order, on their recorded lanes,
+//  through the entry points and in the batches and groups they were
+//  recorded from.
+//
+//  c++ -std=c++17 -DHAVE_NO_USD -Isrc -Ibench -I<concurrentqueue> src/Modes.cpp src/TransactionCapture.cpp bench/TransactionCaptureTest.cpp
+//
+
+#include "Modes.h"
+#include "TransactionCapture.h"
+#include "Check.h"
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace lab;
+
+static std::atomic<size_t> gExecuted { 0 };
+
+static bool Write(const Transaction& t, std::string& bytes)
+{
+    bytes = t.message.Str();
+    return true;
+}
+
+static bool Read(const char* bytes, size_t size, Transaction& t)
+{
+    t = Transaction(std::string(bytes, size), []() { ++gExecuted; });
+    return true;
+}
+
+static std::string TempPath()
+{
+    char path[] = "/tmp/transactioncaptureXXXXXX";
+    int fd = mkstemp(path);
+    close(fd);
+    unlink(path);
+    return path;
+}
+
+static const char* LaneName(TransactionLane lane)
+{
+    return lane == TransactionLane::Background ? "background" : "interactive";
+}
+
+// each thread's tap calls, one line apiece
+class Trace : public TransactionTap
+{
+    std::mutex _lock;
+    std::map<std::thread::id, std::vector<std::string>> _threads;
+
+    void _add(std::string line) {
+        std::lock_guard<std::mutex> lock(_lock);
+        _threads[std::this_thread::get_id()].push_back(std::move(line));
+    }
+
+public:
+    void Enqueued(const Transaction* t, size_t count, TransactionLane lane,
+                  TransactionSource source) override {
+        static const char* sources[] = { "implicit", "producer", "batch" };
+        std::string line = std::string(sources[size_t(source)]) + " " + LaneName(lane) + ":";
+        for (size_t i = 0; i < count; ++i)
+            line += " " + t[i].message.Str();
+        _add(std::move(line));
+    }
+    void GroupBegan(const TransactionMessage& message, TransactionLane lane) override {
+        _add("begin " + message.Str() + " " + LaneName(lane));
+    }
+    void GroupEnded() override {
+        _add("end");
+    }
+
+    // the threads' traces, in an order that does not depend on the threads
+    std::vector<std::vector<std::string>> Threads() {
+        std::vector<std::vector<std::string>> threads;
+        for (auto& t : _threads)
+            threads.push_back(t.second);
+        std::sort(threads.begin(), threads.end());
+        return threads;
+    }
+};
+
+// shows each call to both taps
+class Both : public TransactionTap
+{
+    TransactionTap& _a;
+    TransactionTap& _b;
+public:
+    Both(TransactionTap& a, TransactionTap& b) : _a(a), _b(b) {}
+    void Enqueued(const Transaction* t, size_t count, TransactionLane lane,
+                  TransactionSource source) override {
+        _a.Enqueued(t, count, lane, source);
+        _b.Enqueued(t, count, lane, source);
+    }
+    void GroupBegan(const TransactionMessage& message, TransactionLane lane) override {
+        _a.GroupBegan(message, lane);
+        _b.GroupBegan(message, lane);
+    }
+    void GroupEnded() override {
+        _a.GroupEnded();
+        _b.GroupEnded();
+    }
+};
+
+// every entry point, on both lanes, with batches and groups between them
+static void Produce(ModeManager& mm, int k, int rounds)
+{
+    TransactionProducer p = mm.MakeTransactionProducer(k % 2 ? TransactionLane::Background
+                                                              : TransactionLane::Interactive);
+    int seq = 0;
+    auto next = [k, &seq]() {
+        return Transaction(std::to_string(k) + "/" + std::to_string(seq++), [](){});
+    };
+    for (int r = 0; r < rounds; ++r) {
+        mm.EnqueueTransaction(next(), r % 2 ? TransactionLane::Background : TransactionLane::Interactive);
+        p.Enqueue(next());
+        Transaction batch[3] = { next(), next(), next() };
+        p.Enqueue(batch, 3);
+        mm.BeginTransactionGroup("Group" + std::to_string(k), 2, TransactionLane::Background);
+        mm.EnqueueTransaction(next());
+        p.Enqueue(next());
+        mm.EndTransactionGroup();
+    }
+}
+
+// replay used to send every transaction through a producer, one at a time,
+// whichever way it had been enqueued
+static void TestReplayKeepsEntryPoints()
+{
+    const int threads = 3;
+    const int rounds = 50;
+    std::string path = TempPath();
+    Trace recorded;
+    {
+        ModeManager mm;
+        TransactionCapture capture(Write);
+        CHECK(capture.Open(path));
+        Both tap(capture, recorded);
+        mm.SetTransactionTap(&tap);
+        std::vector<std::thread> producers;
+        for (int k = 0; k < threads; ++k)
+            producers.emplace_back(Produce, std::ref(mm), k, rounds);
+        for (auto& t : producers)
+            t.join();
+        mm.SetTransactionTap(nullptr);
+        capture.Close();
+    }
+
+    Trace replayed;
+    ModeManager mm;
+    mm.SetTransactionTap(&replayed);
+    size_t enqueued = TransactionCapture::Replay(path, mm, Read, 0);
+    mm.SetTransactionTap(nullptr);
+    unlink(path.c_str());
+    CHECK(enqueued == size_t(threads * rounds * 7));
+    CHECK(replayed.Threads() == recorded.Threads());
+
+    mm.UpdateTransactionQueueActivationAndModes();
+    CHECK(gExecuted.load() == enqueued);
+}
+
+int main()
+{
+    TestReplayKeepsEntryPoints();
+    return CheckResult("TransactionCaptureTest");
+}
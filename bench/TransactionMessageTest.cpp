@@ -0,0 +1,140 @@
+//
+//  TransactionMessageTest.cpp
+//  LabExcelsior
+//
+//  Regression tests for TransactionMessage: only an explicit Literal() is
+//  referenced, only an explicit Interned() joins the process wide table, and
+//  other strings, arrays included, are owned by the message, so labels built
+//  per edit are freed with their transactions.
+//
+//  c++ -std=c++17 -DHAVE_NO_USD -Isrc -Ibench -I<concurrentqueue> src/Modes.cpp bench/TransactionMessageTest.cpp
+//
+
+#include "Modes.h"
+#include "Check.h"
+
+#include <atomic>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+using namespace lab;
+
+// a buffer reused for every label used to be referenced as if it were a
+// literal, so the message read whatever the buffer held later, or dead stack
+static TransactionMessage Formatted(int i)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "Move %d", i);
+    return TransactionMessage(buf);
+}
+
+static void TestBufferIsCopied()
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "Move %d", 1);
+    TransactionMessage m(buf);
+    snprintf(buf, sizeof(buf), "Move %d", 2);
+    CHECK(m.Str() == "Move 1");
+
+    TransactionMessage f = Formatted(3);
+    CHECK(f.Str() == "Move 3");
+}
+
+static void TestLiteral()
+{
+    static const char label[] = "Rotate";
+    TransactionMessage m = TransactionMessage::Literal(label);
+    CHECK(m.Str() == "Rotate");
+    CHECK(m.HeapBytes() == 0);
+}
+
+// a label built per edit is owned by its message, and counts against the
+// journal's budget, rather than joining the process wide table
+static void TestStringsAreOwned()
+{
+    std::string label = "Move /a/b/c";
+    TransactionMessage m(label);
+    label[0] = 'X';
+    CHECK(m.Str() == "Move /a/b/c");
+    CHECK(m.HeapBytes() > 0);
+
+    const char* p = "Scale";
+    CHECK(TransactionMessage(p).HeapBytes() > 0);
+    CHECK(TransactionMessage(std::string_view("Scale")).Str() == "Scale");
+
+    TransactionMessage moved = std::move(m);
+    CHECK(moved.Str() == "Move /a/b/c");
+    CHECK(m.Empty());
+
+    Journal j;
+    size_t before = j.RetainedBytes();
+    j.Append(Transaction(std::string(200, 'x'), [](){}));
+    CHECK(j.RetainedBytes() >= before + 200);
+    j.Truncate(j.Root());
+    CHECK(j.RetainedBytes() == before);
+}
+
+// arrays were interned, which took the table's lock on every enqueue, and
+// kept every label formatted into a stack buffer for good
+static void TestArraysAreOwned()
+{
+    size_t interned = TransactionMessage::InternedCount();
+    TransactionMessage a("Select");
+    CHECK(a.Str() == "Select");
+    CHECK(a.HeapBytes() > 0);
+    for (int i = 0; i < 100; ++i)
+        CHECK(Formatted(i).Str() == "Move " + std::to_string(i));
+    CHECK(TransactionMessage::InternedCount() == interned);
+}
+
+// interning is explicit, and each label is stored once however many threads
+// intern it, and however often
+static void TestInterned()
+{
+    size_t interned = TransactionMessage::InternedCount();
+    TransactionMessage a = TransactionMessage::Interned(std::string("Select"));
+    CHECK(a.Str() == "Select");
+    CHECK(a.HeapBytes() == 0);
+    CHECK(TransactionMessage::InternedCount() == interned + 1);
+
+    std::atomic<int> wrong { 0 };
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&wrong]() {
+            for (int i = 0; i < 1000; ++i) {
+                std::string label = i % 2 ? "Select" : "Deselect";
+                TransactionMessage m = TransactionMessage::Interned(label);
+                if (m.Str() != label)
+                    ++wrong;
+            }
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+    CHECK(wrong.load() == 0);
+    CHECK(TransactionMessage::InternedCount() == interned + 2);
+}
+
+static void TestDeferred()
+{
+    int calls = 0;
+    TransactionMessage m = TransactionMessage::Deferred([&calls]() {
+        ++calls;
+        return std::string("Deferred");
+    });
+    CHECK(calls == 0);
+    CHECK(m.Str() == "Deferred");
+    CHECK(calls == 1);
+}
+
+int main()
+{
+    TestBufferIsCopied();
+    TestLiteral();
+    TestStringsAreOwned();
+    TestArraysAreOwned();
+    TestInterned();
+    TestDeferred();
+    return CheckResult("TransactionMessageTest");
+}
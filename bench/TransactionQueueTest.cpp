@@ -0,0 +1,396 @@
+//
+//  TransactionQueueTest.cpp
+//  LabExcelsior
+//
+//  Regression tests for the ModeManager's transaction queue: how drained
+//  transactions are executed and journaled, admission under a capacity,
+//  and transaction groups.
+//
+//  c++ -std=c++17 -DHAVE_NO_USD -Isrc -Ibench -I<concurrentqueue> src/Modes.cpp bench/TransactionQueueTest.cpp
+//
+
+#include "Modes.h"
+#include "Check.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace lab;
+
+static Transaction Set(int& state, int value)
+{
+    int* p = &state;
+    auto prev = std::make_shared<int>(0);
+    return Transaction("Set",
+        [p, value, prev]() { *prev = *p; *p = value; },
+        [p, prev]() { *p = *prev; });
+}
+
+// the frame's transactions used to all run before any was journaled, so a
+// checkpoint taken as a node was appended held the state at the end of the
+// frame rather than the state after the node
+static void TestCheckpointsSeeEachTransaction(unsigned workers)
+{
+    ModeManager mm;
+    mm.SetTransactionWorkers(workers);
+    int state = 0;
+    mm.Journal().SetCheckpoints(1,
+        [&state]() { return std::make_shared<int>(state); },
+        [&state](const Journal::Snapshot& s) { state = *std::static_pointer_cast<int>(s); });
+
+    for (int v = 1; v <= 3; ++v) {
+        Transaction t = Set(state, v);
+        t.conflict_key = v;     // disjoint, as far as the workers know
+        mm.EnqueueTransaction(std::move(t));
+    }
+    mm.UpdateTransactionQueueActivationAndModes();
+    CHECK(state == 3);
+
+    Journal& j = mm.Journal();
+    JournalIndex first = j.Node(j.Root()).next;
+    CHECK(first != kJournalNil);
+    j.JumpTo(first);
+    CHECK(state == 1);
+    j.JumpTo(j.Node(first).next);
+    CHECK(state == 2);
+}
+
+// a drag ended its merge span on the journal when its end interaction was
+// handled, before the queue had delivered its last transaction, which then
+// became an undo step of its own
+static void TestDragStaysOneStep()
+{
+    ModeManager mm;
+    int state = 0;
+    auto drag = [&state](int value, bool continues) {
+        Transaction t = Set(state, value);
+        t.merge_key = 7;
+        t.merge_continues = continues;
+        return t;
+    };
+    mm.EnqueueTransaction(drag(1, false));
+    mm.UpdateTransactionQueueActivationAndModes();
+    mm.EnqueueTransaction(drag(2, true));
+    mm.EnqueueTransaction(drag(3, true));
+    mm.UpdateTransactionQueueActivationAndModes();
+    mm.EnqueueTransaction(drag(4, true));      // the drag has ended by now
+    mm.UpdateTransactionQueueActivationAndModes();
+
+    Journal& j = mm.Journal();
+    JournalIndex step = j.Node(j.Root()).next;
+    CHECK(step != kJournalNil && j.Node(step).next == kJournalNil);
+    CHECK(state == 4);
+    j.Undo(1);
+    CHECK(state == 0);
+    j.Redo(1);
+    CHECK(state == 4);
+
+    // the next drag on the same property is a step of its own
+    mm.EnqueueTransaction(drag(5, false));
+    mm.EnqueueTransaction(drag(6, true));
+    mm.UpdateTransactionQueueActivationAndModes();
+    CHECK(j.Node(step).next != kJournalNil);
+    CHECK(j.Node(j.Node(step).next).next == kJournalNil);
+    j.Undo(1);
+    CHECK(state == 4);
+}
+
+// runs frames until done is set, or frames run out
+static bool RunFrames(ModeManager& mm, const std::atomic<bool>& done, int frames = 200)
+{
+    for (int i = 0; i < frames && !done.load(); ++i) {
+        mm.UpdateTransactionQueueActivationAndModes();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    mm.UpdateTransactionQueueActivationAndModes();
+    return done.load();
+}
+
+// a blocking batch larger than the capacity used to wait for room that
+// could never appear
+static void TestOversizedBatchIsAdmitted()
+{
+    ModeManager mm;
+    mm.SetTransactionCapacity(4);
+    int ran = 0;
+    std::atomic<bool> done { false };
+    std::thread producer([&mm, &ran, &done]() {
+        TransactionProducer p = mm.MakeTransactionProducer();
+        p.Enqueue(Transaction("One", [&ran]() { ++ran; }));
+        p.Enqueue(Transaction("Two", [&ran]() { ++ran; }));
+        std::vector<Transaction> batch;
+        for (int i = 0; i < 8; ++i)
+            batch.emplace_back("Batch", [&ran]() { ++ran; });
+        p.Enqueue(batch.data(), batch.size());
+        done.store(true);
+    });
+    CHECK(RunFrames(mm, done));
+    mm.SetTransactionCapacity(0);   // releases the producer if it is stuck
+    producer.join();
+    mm.UpdateTransactionQueueActivationAndModes();
+    CHECK(ran == 10);
+    CHECK(mm.QueueStats().depth == 0);
+}
+
+// the frame thread was unknown until the first frame, so the main thread
+// enqueuing at capacity before then blocked on itself
+static void TestFrameThreadAdmittedBeforeFirstFrame()
+{
+    ModeManager mm;
+    mm.SetTransactionCapacity(1);
+    std::atomic<bool> done { false };
+    std::atomic<bool> stuck { false };
+    std::thread watchdog([&mm, &done, &stuck]() {
+        for (int i = 0; i < 2000 && !done.load(); ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        if (!done.load()) {
+            stuck.store(true);
+            mm.SetTransactionCapacity(0);
+        }
+    });
+    int ran = 0;
+    mm.EnqueueTransaction(Transaction("One", [&ran]() { ++ran; }));
+    mm.EnqueueTransaction(Transaction("Two", [&ran]() { ++ran; }));
+    done.store(true);
+    watchdog.join();
+    CHECK(!stuck.load());
+    CHECK(mm.QueueStats().depth == 2);
+    mm.UpdateTransactionQueueActivationAndModes();
+    CHECK(ran == 2);
+}
+
+// a worker whose transaction enqueued at capacity waited for room, while
+// the frame thread waited for the worker to finish
+static void TestWorkersAdmittedAtCapacity()
+{
+    ModeManager mm;
+    mm.SetTransactionWorkers(2);
+    mm.SetTransactionCapacity(1);
+    std::atomic<int> followups { 0 };
+    for (int i = 0; i < 8; ++i) {
+        Transaction t("Spawn", [&mm, &followups]() {
+            // long enough for the workers to take some of the others
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            for (int k = 0; k < 2; ++k)
+                mm.EnqueueTransaction(Transaction("Follow", [&followups]() { ++followups; }));
+        });
+        t.conflict_key = i + 1;
+        mm.EnqueueTransaction(std::move(t));
+    }
+
+    std::atomic<bool> done { false };
+    std::atomic<bool> stuck { false };
+    std::thread watchdog([&mm, &done, &stuck]() {
+        for (int i = 0; i < 2000 && !done.load(); ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        if (!done.load()) {
+            stuck.store(true);
+            mm.SetTransactionCapacity(0);
+        }
+    });
+    mm.UpdateTransactionQueueActivationAndModes();
+    done.store(true);
+    watchdog.join();
+    CHECK(!stuck.load());
+    mm.UpdateTransactionQueueActivationAndModes();
+    CHECK(followups.load() == 16);
+}
+
+// a group refused by a full FailFast queue used to vanish silently, leaving
+// its members' completions unresolved
+static void TestRefusedGroupIsReported()
+{
+    ModeManager mm;
+    mm.SetTransactionCapacity(1, TransactionOverflow::FailFast);
+    bool ended = true;
+    bool scoped = true;
+    TransactionCompletion member;
+    std::thread producer([&]() {
+        CHECK(mm.EnqueueTransaction(Transaction("Fill", [](){})));
+        mm.BeginTransactionGroup("Group");
+        Transaction t("Member", [](){});
+        member = mm.TrackTransaction(t);
+        mm.EnqueueTransaction(std::move(t));
+        mm.EnqueueTransaction(Transaction("Member", [](){}));
+        ended = mm.EndTransactionGroup();
+
+        TransactionGroupScope scope(mm, "Scoped");
+        mm.EnqueueTransaction(Transaction("Member", [](){}));
+        scoped = scope.End();
+    });
+    producer.join();
+    CHECK(!ended);
+    CHECK(!scoped);
+    CHECK(member.Ready());
+    CHECK(member.Refused());
+    member.Wait();
+    CHECK(mm.QueueStats().rejected == 2);
+
+    mm.UpdateTransactionQueueActivationAndModes();
+    TransactionCompletion ok = mm.EnqueueTransactionWithCompletion(Transaction("Later", [](){}));
+    mm.UpdateTransactionQueueActivationAndModes();
+    CHECK(ok.Ready());
+    CHECK(!ok.Refused());
+}
+
+// completions were chained through nested pointers, so freeing a long chain
+// recursed once per link and overflowed the stack
+static void TestLongCompletionChains()
+{
+    ModeManager mm;
+    const int members = 1000000;
+    std::vector<TransactionCompletion> some;
+    mm.BeginTransactionGroup("Group", members);
+    for (int i = 0; i < members; ++i) {
+        Transaction t("Member", [](){});
+        TransactionCompletion c = mm.TrackTransaction(t);
+        if (i % 100000 == 0)
+            some.push_back(std::move(c));
+        mm.EnqueueTransaction(std::move(t));
+    }
+    CHECK(mm.EndTransactionGroup());
+    mm.UpdateTransactionQueueActivationAndModes();
+    for (auto& c : some)
+        CHECK(c.Ready() && !c.Refused());
+
+    // the same through an overflow slot, which folds every transaction with
+    // the key into one
+    mm.SetTransactionCapacity(1, TransactionOverflow::DropOldestMergeable);
+    std::thread producer([&mm, &some]() {
+        some.clear();
+        Transaction fill("Fill", [](){});
+        mm.EnqueueTransaction(std::move(fill));
+        for (int i = 0; i < 200000; ++i) {
+            Transaction t("Drag", [](){});
+            t.merge_key = 9;
+            TransactionCompletion c = mm.TrackTransaction(t);
+            if (i % 50000 == 0)
+                some.push_back(std::move(c));
+            mm.EnqueueTransaction(std::move(t));
+        }
+    });
+    producer.join();
+    mm.UpdateTransactionQueueActivationAndModes();
+    mm.UpdateTransactionQueueActivationAndModes();
+    for (auto& c : some)
+        CHECK(c.Ready() && !c.Refused());
+}
+
+// a refused transaction's completion was replaced by an empty one, which
+// could not say that it had been refused
+static void TestRefusedCompletionIsReported()
+{
+    ModeManager mm;
+    mm.SetTransactionCapacity(1, TransactionOverflow::FailFast);
+    TransactionCompletion refused;
+    std::thread producer([&mm, &refused]() {
+        mm.EnqueueTransaction(Transaction("Fill", [](){}));
+        refused = mm.EnqueueTransactionWithCompletion(Transaction("Refused", [](){}));
+    });
+    producer.join();
+    CHECK(refused);
+    CHECK(refused.Ready());
+    CHECK(refused.Refused());
+}
+
+// a transaction that overflowed into a slot waited for the end of the frame,
+// so a later transaction on its lane, admitted as soon as the frame made
+// room, could run before it: the end of a drag before the drag
+static void TestSlotKeepsItsPlaceInTheLane(bool tokens)
+{
+    for (int run = 0; run < 20; ++run) {
+        ModeManager mm;
+        mm.SetTransactionCapacity(2, TransactionOverflow::DropOldestMergeable);
+        std::vector<int> order;
+        auto step = [&order](int n) {
+            return Transaction("Step", [&order, n]() { order.push_back(n); });
+        };
+        std::atomic<bool> done { false };
+        std::thread producer([&]() {
+            TransactionProducer p = mm.MakeTransactionProducer();
+            auto enqueue = [&](Transaction&& t) {
+                if (tokens)
+                    p.Enqueue(std::move(t));
+                else
+                    mm.EnqueueTransaction(std::move(t));
+            };
+            // the frame makes room before running what it drained, and
+            // this gives the producer time to take it
+            Transaction first = step(1);
+            first.exec = [exec = std::move(first.exec)]() {
+                std::this_thread::sleep_for(std::chrono::milliseconds(2));
+                exec();
+            };
+            enqueue(std::move(first));
+            enqueue(step(2));
+            Transaction drag = step(3);
+            drag.merge_key = 7;
+            enqueue(std::move(drag));
+            enqueue(step(4));
+            done.store(true);
+        });
+        for (int i = 0; i < 2000 && (!done.load() || order.size() < 4); ++i) {
+            mm.UpdateTransactionQueueActivationAndModes();
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        producer.join();
+        std::vector<int> expect = { 1, 2, 3, 4 };
+        CHECK(order == expect);
+    }
+}
+
+// an unbounded queue no longer counts its depth on every enqueue, so the
+// counters are derived from the lanes, and pick up from them when a capacity
+// is set
+static void TestUnboundedCounters()
+{
+    ModeManager mm;
+    std::thread producer([&mm]() {
+        for (int i = 0; i < 5; ++i)
+            mm.EnqueueTransaction(Transaction("Move", [](){}));
+    });
+    producer.join();
+    TransactionQueueStats s = mm.QueueStats();
+    CHECK(s.depth == 5);
+    CHECK(s.enqueued == 5);
+    mm.UpdateTransactionQueueActivationAndModes();
+    s = mm.QueueStats();
+    CHECK(s.depth == 0);
+    CHECK(s.enqueued == 5);
+    CHECK(s.high_water == 5);
+
+    for (int i = 0; i < 3; ++i)
+        mm.EnqueueTransaction(Transaction("Move", [](){}));
+    mm.SetTransactionCapacity(4, TransactionOverflow::FailFast);
+    CHECK(mm.QueueStats().depth == 3);
+    std::thread bounded([&mm]() {
+        CHECK(mm.EnqueueTransaction(Transaction("Move", [](){})));
+        CHECK(!mm.EnqueueTransaction(Transaction("Move", [](){})));
+    });
+    bounded.join();
+    mm.UpdateTransactionQueueActivationAndModes();
+    s = mm.QueueStats();
+    CHECK(s.depth == 0);
+    CHECK(s.enqueued == 9);
+    CHECK(s.rejected == 1);
+}
+
+int main()
+{
+    TestCheckpointsSeeEachTransaction(0);
+    TestCheckpointsSeeEachTransaction(2);
+    TestDragStaysOneStep();
+    TestOversizedBatchIsAdmitted();
+    TestFrameThreadAdmittedBeforeFirstFrame();
+    TestWorkersAdmittedAtCapacity();
+    TestRefusedGroupIsReported();
+    TestLongCompletionChains();
+    TestRefusedCompletionIsReported();
+    TestSlotKeepsItsPlaceInTheLane(false);
+    TestSlotKeepsItsPlaceInTheLane(true);
+    TestUnboundedCounters();
+    return CheckResult("TransactionQueueTest");
+}
@@ -0,0 +1,92 @@
+//
+//  TransactionRingBench.cpp
+//  LabExcelsior
+//
+//  Transactions per second through the bundled MPSC TransactionRing and
+//  through moodycamel's ConcurrentQueue, with producers enqueuing singly and
+//  in batches, and the frame thread draining in bulk, as the ModeManager
+//  does. For the ring, the share of transactions that went through its
+//  locked spill rather than the slots is shown as well.
+//
+//  c++ -std=c++17 -O2 -DHAVE_NO_USD -Isrc -I<concurrentqueue> src/Modes.cpp bench/TransactionRingBench.cpp
+//
+
+#include "Modes.h"
+#include "TransactionRing.h"
+#include "concurrentqueue.hpp"
+
+#include <chrono>
+#include <iterator>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+using namespace lab;
+using Clock = std::chrono::steady_clock;
+
+// the transactions that spilled, where the queue has a spill to count
+template <typename Queue>
+static size_t Spills(const Queue&) { return 0; }
+
+template <typename T, size_t Capacity>
+static size_t Spills(const TransactionRing<T, Capacity>& ring) { return ring.spill_count(); }
+
+template <typename Queue>
+static void Run(const char* name, int batch, int producers, int per_producer)
+{
+    Queue queue;
+    typename Queue::consumer_token_t consumer(queue);
+    std::vector<Transaction> buffer(256);
+    double sink = 0;
+
+    auto t0 = Clock::now();
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; ++p) {
+        threads.emplace_back([&queue, &sink, batch, per_producer]() {
+            typename Queue::producer_token_t token(queue);
+            if (batch == 1) {
+                for (int i = 0; i < per_producer; ++i)
+                    queue.enqueue(token, Transaction("Move", [&sink, i]() { sink += i; }));
+                return;
+            }
+            std::vector<Transaction> pending;
+            pending.reserve(batch);
+            for (int i = 0; i < per_producer; ++i) {
+                pending.emplace_back("Move", [&sink, i]() { sink += i; });
+                if (pending.size() == size_t(batch) || i == per_producer - 1) {
+                    queue.enqueue_bulk(token, std::make_move_iterator(pending.begin()), pending.size());
+                    pending.clear();
+                }
+            }
+        });
+    }
+
+    const int total = producers * per_producer;
+    int drained = 0;
+    while (drained < total) {
+        size_t got = queue.try_dequeue_bulk(consumer, buffer.begin(), buffer.size());
+        for (size_t i = 0; i < got; ++i)
+            buffer[i].exec();
+        drained += static_cast<int>(got);
+    }
+    for (auto& th : threads)
+        th.join();
+    auto t1 = Clock::now();
+
+    double s = std::chrono::duration<double>(t1 - t0).count();
+    printf("%-12s batch %2d %2d producers %8d transactions %9.3f ms %8.2f Mtx/s %6.2f%% spilled\n",
+           name, batch, producers, total, s * 1e3, total / s * 1e-6,
+           100.0 * Spills(queue) / total);
+}
+
+int main()
+{
+    const int total = 1 << 21;
+    for (int batch : { 1, 32 }) {
+        for (int producers : { 1, 2, 4, 8, 16, 32 }) {
+            Run<moodycamel::ConcurrentQueue<Transaction>>("moodycamel", batch, producers, total / producers);
+            Run<TransactionRing<Transaction>>("ring", batch, producers, total / producers);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,175 @@
+//
+//  TransactionRingTest.cpp
+//  LabExcelsior
+//
+//  Regression tests for TransactionRing: a producer that spilled goes back
+//  to the ring as soon as it has room, spilled items are taken ahead of the
+//  slots claimed after them, and each producer's items come out in the
+//  order it enqueued them.
+//
+//  c++ -std=c++17 -Isrc -Ibench bench/TransactionRingTest.cpp
+//
+
+#include "TransactionRing.h"
+#include "Check.h"
+
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+using namespace lab;
+
+using Ring = TransactionRing<uint64_t, 8>;
+
+static std::vector<uint64_t> Drain(Ring& ring)
+{
+    std::vector<uint64_t> out;
+    uint64_t buffer[5];
+    while (size_t n = ring.try_dequeue_bulk(buffer, 5))
+        out.insert(out.end(), buffer, buffer + n);
+    return out;
+}
+
+static bool Counts(const std::vector<uint64_t>& v, uint64_t from, uint64_t to)
+{
+    if (v.size() != to - from)
+        return false;
+    for (size_t i = 0; i < v.size(); ++i)
+        if (v[i] != from + i)
+            return false;
+    return true;
+}
+
+// only what does not fit in the ring spills, batches included, and the
+// spilled items come out after the ring's, in order
+static void TestOnlyOverflowSpills()
+{
+    Ring ring;
+    for (uint64_t i = 0; i < 16; ++i)
+        ring.enqueue(uint64_t(i));
+    CHECK(ring.spill_count() == 8);
+    CHECK(ring.size_approx() == 16);
+    CHECK(Counts(Drain(ring), 0, 16));
+
+    for (uint64_t i = 16; i < 24; ++i)
+        ring.enqueue(uint64_t(i));
+    CHECK(ring.spill_count() == 8);
+    CHECK(Counts(Drain(ring), 16, 24));
+
+    Ring::producer_token_t token(ring);
+    uint64_t batch[12];
+    for (uint64_t i = 0; i < 12; ++i)
+        batch[i] = 24 + i;
+    ring.enqueue_bulk(token, batch, 4);
+    ring.enqueue_bulk(token, batch + 4, 8);
+    CHECK(ring.spill_count() == 16);
+    CHECK(Counts(Drain(ring), 24, 36));
+    ring.enqueue(token, uint64_t(36));
+    CHECK(ring.spill_count() == 16);
+    CHECK(Counts(Drain(ring), 36, 37));
+    CHECK(ring.size_approx() == 0);
+}
+
+// with a few items left in the spill and the consumer taking as many each
+// frame as the producer adds, the spill never emptied, so everything spilled
+// from then on; now the producer goes back to the ring and the spill drains
+static void TestSteadyLoadLeavesTheSpill()
+{
+    Ring ring;
+    uint64_t next = 0, expect = 0;
+    for (; next < 12; ++next)
+        ring.enqueue(uint64_t(next));
+    uint64_t buffer[8];
+    CHECK(ring.try_dequeue_bulk(buffer, 8) == 8);
+    expect = 8;
+    CHECK(ring.spill_count() == 4);
+
+    bool ordered = true;
+    for (int frame = 0; frame < 50; ++frame) {
+        ring.enqueue(uint64_t(next++));
+        ring.enqueue(uint64_t(next++));
+        size_t n = ring.try_dequeue_bulk(buffer, 2);
+        for (size_t i = 0; i < n; ++i)
+            ordered = ordered && buffer[i] == expect++;
+    }
+    CHECK(ordered);
+    CHECK(ring.spill_count() == 4);
+    CHECK(Counts(Drain(ring), expect, next));
+}
+
+// a producer goes back to the ring while its spilled items still wait, and
+// those come out before anything claimed in the ring after they spilled
+static void TestSpilledItemsKeepTheirPlace()
+{
+    Ring ring;
+    Ring::producer_token_t a(ring), b(ring);
+    for (uint64_t i = 0; i < 12; ++i)
+        ring.enqueue(a, uint64_t(i));
+    CHECK(ring.spill_count() == 4);
+
+    uint64_t buffer[8];
+    CHECK(ring.try_dequeue_bulk(buffer, 6) == 6);
+    ring.enqueue(a, uint64_t(12));
+    ring.enqueue(b, uint64_t(100));
+    ring.enqueue(b, uint64_t(101));
+    CHECK(ring.spill_count() == 4);
+    CHECK(ring.size_approx() == 9);
+
+    std::vector<uint64_t> out = Drain(ring);
+    std::vector<uint64_t> expect = { 6, 7, 8, 9, 10, 11, 12, 100, 101 };
+    CHECK(out == expect);
+}
+
+// producers hammering a small ring: nothing lost, each producer's items in
+// order, and not everything spilled
+static void TestProducerOrderUnderContention(bool tokens)
+{
+    const int producers = 4;
+    const uint64_t per_producer = 50000;
+    Ring ring;
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; ++p) {
+        threads.emplace_back([&ring, p, tokens, per_producer]() {
+            Ring::producer_token_t token(ring);
+            for (uint64_t i = 0; i < per_producer; ++i) {
+                uint64_t item = (uint64_t(p) << 32) | i;
+                if (tokens)
+                    ring.enqueue(token, std::move(item));
+                else
+                    ring.enqueue(std::move(item));
+            }
+        });
+    }
+
+    std::vector<uint64_t> next(producers, 0);
+    uint64_t received = 0;
+    bool ordered = true;
+    uint64_t buffer[5];
+    while (received < producers * per_producer) {
+        size_t n = ring.try_dequeue_bulk(buffer, 5);
+        for (size_t i = 0; i < n; ++i) {
+            uint64_t p = buffer[i] >> 32;
+            uint64_t seq = buffer[i] & 0xffffffffu;
+            if (p >= uint64_t(producers) || seq != next[p])
+                ordered = false;
+            else
+                ++next[p];
+        }
+        received += n;
+    }
+    for (auto& t : threads)
+        t.join();
+    CHECK(ordered);
+    CHECK(ring.size_approx() == 0);
+    CHECK(ring.spill_count() < received);
+}
+
+int main()
+{
+    TestOnlyOverflowSpills();
+    TestSteadyLoadLeavesTheSpill();
+    TestSpilledItemsKeepTheirPlace();
+    TestProducerOrderUnderContention(true);
+    TestProducerOrderUnderContention(false);
+    return CheckResult("TransactionRingTest");
+}
@@ -0,0 +1,153 @@
+//
+//  InlineFunction.h
+//  LabExcelsior
+//
+//  Copyright © 2023. All rights reserved.
+//
+
+/*
+ InlineFunction is a move only replacement for std::function. Callables
+ that fit in Capacity bytes, and that can be moved without throwing, are
+ stored in place, so constructing, moving, and destroying one does not touch
+ the heap. Larger callables are stored on the heap, as std::function would.
+
+ An empty InlineFunction owns nothing and costs nothing to construct.
+ */
+
+#ifndef InlineFunction_h
+#define InlineFunction_h
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace lab {
+
+template <typename Signature, size_t Capacity>
+class InlineFunction;
+
+template <typename R, typename... Args, size_t Capacity>
+class InlineFunction<R(Args...), Capacity>
+{
+    static_assert(Capacity >= sizeof(void*), "capacity must hold at least a pointer");
+
+    struct Ops {
+        R (*invoke)(void* storage, Args&&... args);
+        void (*relocate)(void* dst, void* src);     // moves src into dst, ending src
+        void (*destroy)(void* storage);
+        size_t heap;                                // bytes on the heap, zero if inline
+    };
+
+    template <typename F>
+    struct Inline {
+        static R invoke(void* s, Args&&... args) {
+            return (*static_cast<F*>(s))(std::forward<Args>(args)...);
+        }
+        static void relocate(void* dst, void* src) {
+            F* f = static_cast<F*>(src);
+            ::new (dst) F(std::move(*f));
+            f->~F();
+        }
+        static void destroy(void* s) { static_cast<F*>(s)->~F(); }
+        static constexpr Ops ops = { invoke, relocate, destroy, 0 };
+    };
+
+    template <typename F>
+    struct Heap {
+        static F* get(void* s) { return *static_cast<F**>(s); }
+        static R invoke(void* s, Args&&... args) {
+            return (*get(s))(std::forward<Args>(args)...);
+        }
+        static void relocate(void* dst, void* src) { ::new (dst) F*(get(src)); }
+        static void destroy(void* s) { delete get(s); }
+        static constexpr Ops ops = { invoke, relocate, destroy, sizeof(F) };
+    };
+
+    template <typename F>
+    static constexpr bool _fits = sizeof(F) <= Capacity
+                               && alignof(F) <= alignof(std::max_align_t)
+                               && std::is_nothrow_move_constructible<F>::value;
+
+    template <typename F>
+    static bool _empty(const F&) { return false; }
+    template <typename S>
+    static bool _empty(const std::function<S>& f) { return !f; }
+    template <typename T>
+    static bool _empty(T* p) { return !p; }
+
+    alignas(std::max_align_t) mutable unsigned char _storage[Capacity];
+    const Ops* _ops = nullptr;
+
+public:
+    InlineFunction() noexcept = default;
+    InlineFunction(std::nullptr_t) noexcept {}
+
+    template <typename F, typename D = typename std::decay<F>::type,
+              typename = typename std::enable_if<
+                  !std::is_same<D, InlineFunction>::value &&
+                  std::is_invocable_r<R, D&, Args...>::value>::type>
+    InlineFunction(F&& f)
+    {
+        if (_empty(f))
+            return;
+        if constexpr (_fits<D>) {
+            ::new (static_cast<void*>(_storage)) D(std::forward<F>(f));
+            _ops = &Inline<D>::ops;
+        }
+        else {
+            ::new (static_cast<void*>(_storage)) D*(new D(std::forward<F>(f)));
+            _ops = &Heap<D>::ops;
+        }
+    }
+
+    InlineFunction(InlineFunction&& f) noexcept
+    {
+        if (f._ops) {
+            f._ops->relocate(_storage, f._storage);
+            _ops = f._ops;
+            f._ops = nullptr;
+        }
+    }
+
+    InlineFunction& operator=(InlineFunction&& f) noexcept
+    {
+        if (this != &f) {
+            reset();
+            if (f._ops) {
+                f._ops->relocate(_storage, f._storage);
+                _ops = f._ops;
+                f._ops = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    InlineFunction(const InlineFunction&) = delete;
+    InlineFunction& operator=(const InlineFunction&) = delete;
+
+    ~InlineFunction() { reset(); }
+
+    void reset() noexcept
+    {
+        if (_ops) {
+            _ops->destroy(_storage);
+            _ops = nullptr;
+        }
+    }
+
+    R operator()(Args... args) const
+    {
+        return _ops->invoke(_storage, std::forward<Args>(args)...);
+    }
+
+    explicit operator bool() const noexcept { return _ops != nullptr; }
+
+    // bytes the callable occupies on the heap; zero when it is stored inline
+    size_t HeapBytes() const noexcept { return _ops ? _ops->heap : 0; }
+};
+
+} // lab
+
+#endif /* InlineFunction_h */
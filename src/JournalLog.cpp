@@ -0,0 +1,361 @@
+//
+//  JournalLog.cpp
+//  LabExcelsior
+//
+//  Copyright © 2023. All rights reserved.
+//
+
+#include "JournalLog.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace lab {
+
+namespace {
+
+enum RecordKind : uint32_t {
+    kRecordAppend = 1,
+    kRecordFork = 2,
+    kRecordMerge = 3,
+    kRecordRemove = 4,
+    kRecordEvict = 5,
+};
+
+struct RecordHeader {
+    uint32_t kind;
+    uint32_t size;      // payload bytes following the header
+    uint64_t id;
+    uint64_t link;      // parent for appends, fork origin for forks
+    uint32_t check;
+    uint32_t reserved;
+};
+
+const char kMagic[8] = { 'L', 'A', 'B', 'J', 'R', 'N', 'L', '1' };
+const size_t kInitialSize = 1 << 20;
+
+uint32_t Checksum(const RecordHeader& h, const char* payload)
+{
+    uint32_t c = 2166136261u;
+    auto mix = [&c](const void* p, size_t n) {
+        const unsigned char* b = static_cast<const unsigned char*>(p);
+        for (size_t i = 0; i < n; ++i)
+            c = (c ^ b[i]) * 16777619u;
+    };
+    mix(&h.kind, sizeof(h.kind));
+    mix(&h.size, sizeof(h.size));
+    mix(&h.id, sizeof(h.id));
+    mix(&h.link, sizeof(h.link));
+    mix(payload, h.size);
+    return c;
+}
+
+} // anon
+
+JournalLog::JournalLog(TransactionWriter write)
+    : _write(std::move(write))
+{
+}
+
+JournalLog::~JournalLog()
+{
+    if (_writer.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            _stop = true;
+        }
+        _wake.notify_one();
+        _writer.join();
+    }
+    if (_map)
+        munmap(_map, _mapped);
+    if (_fd >= 0)
+        close(_fd);
+}
+
+bool JournalLog::Open(const std::string& path)
+{
+    if (_fd >= 0)
+        return false;
+
+    _fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (_fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(_fd, &st) != 0) {
+        close(_fd);
+        _fd = -1;
+        return false;
+    }
+
+    bool fresh = st.st_size == 0;
+    size_t size = fresh ? kInitialSize : static_cast<size_t>(st.st_size);
+    if (fresh && ftruncate(_fd, size) != 0) {
+        close(_fd);
+        _fd = -1;
+        return false;
+    }
+
+    void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (map == MAP_FAILED) {
+        close(_fd);
+        _fd = -1;
+        return false;
+    }
+    _map = static_cast<char*>(map);
+    _mapped = size;
+
+    if (fresh)
+        memcpy(_map, kMagic, sizeof(kMagic));
+    else if (size < sizeof(kMagic) || memcmp(_map, kMagic, sizeof(kMagic)) != 0) {
+        munmap(_map, _mapped);
+        close(_fd);
+        _map = nullptr;
+        _mapped = 0;
+        _fd = -1;
+        return false;
+    }
+
+    // anything past the last valid record is the remains of an interrupted
+    // write, and is cleared so it cannot be mistaken for a record later
+    _end = _scan();
+    memset(_map + _end, 0, _mapped - _end);
+
+    _writer = std::thread([this]() { _run(); });
+    return true;
+}
+
+size_t JournalLog::_scan() const
+{
+    size_t offset = sizeof(kMagic);
+    while (offset + sizeof(RecordHeader) <= _mapped) {
+        RecordHeader h;
+        memcpy(&h, _map + offset, sizeof(h));
+        if (h.kind < kRecordAppend || h.kind > kRecordEvict)
+            break;
+        if (h.size > _mapped - offset - sizeof(h))
+            break;
+        if (h.check != Checksum(h, _map + offset + sizeof(h)))
+            break;
+        offset += sizeof(h) + h.size;
+    }
+    return offset;
+}
+
+void JournalLog::_set_id(JournalIndex i, uint64_t id)
+{
+    if (i >= _ids.size())
+        _ids.resize(i + 1, 0);
+    _ids[i] = id;
+}
+
+JournalIndex JournalLog::Recover(Journal& journal, const TransactionReader& read)
+{
+    JournalIndex root = journal.Root();
+    JournalIndex last = root;
+    if (!_map)
+        return last;
+
+    // replaying through a sink would record every node again
+    JournalSink* sink = journal.Sink();
+    journal.SetSink(nullptr);
+
+    std::unordered_map<uint64_t, JournalIndex> nodes;
+    nodes[0] = root;
+    _set_id(root, 0);
+
+    size_t offset = sizeof(kMagic);
+    while (offset < _end) {
+        RecordHeader h;
+        memcpy(&h, _map + offset, sizeof(h));
+        const char* payload = _map + offset + sizeof(h);
+        offset += sizeof(h) + h.size;
+
+        bool added = h.kind == kRecordAppend || h.kind == kRecordFork;
+        auto target = nodes.find(added ? h.link : h.id);
+        if (target == nodes.end())
+            continue;
+
+        // removals and evictions are replayed as they happened; if the last
+        // node goes, the nearest node that survives stands in for it
+        if (h.kind == kRecordRemove) {
+            JournalIndex parent = journal.Node(target->second).parent;
+            for (JournalIndex i = last; i != kJournalNil; i = journal.Node(i).parent) {
+                if (i == target->second) {
+                    last = parent;
+                    break;
+                }
+            }
+            journal.Remove(target->second);
+            nodes.erase(target);
+            continue;
+        }
+        if (h.kind == kRecordEvict) {
+            if (journal.Node(target->second).parent != root)
+                continue;
+            if (!journal.EvictOldest())
+                continue;
+            if (last == target->second)
+                last = root;
+            nodes.erase(target);
+            continue;
+        }
+
+        Transaction t;
+        if (!read || !read(payload, h.size, t))
+            t = Transaction();
+
+        journal.Seek(target->second);
+        switch (h.kind) {
+            case kRecordAppend: journal.Append(std::move(t)); break;
+            case kRecordFork:   journal.Fork(std::move(t)); break;
+            case kRecordMerge:  journal.Merge(std::move(t)); break;
+        }
+
+        last = journal.Current();
+        if (added) {
+            nodes[h.id] = last;
+            _set_id(last, h.id);
+            if (h.id >= _next_id)
+                _next_id = h.id + 1;
+        }
+    }
+
+    journal.Seek(root);
+    journal.SetSink(sink);
+    return last;
+}
+
+void JournalLog::_stage(uint32_t kind, uint64_t id, uint64_t link, const Transaction& t)
+{
+    if (_fd < 0 || _failed.load(std::memory_order_relaxed))
+        return;
+
+    // a transaction the writer cannot encode is still recorded, so that
+    // the records after it can find their place in the tree
+    _scratch.clear();
+    if (!_write || !_write(t, _scratch))
+        _scratch.clear();
+    _stage(kind, id, link, _scratch.data(), _scratch.size());
+}
+
+void JournalLog::_stage(uint32_t kind, uint64_t id, uint64_t link, const char* payload, size_t size)
+{
+    if (_fd < 0 || _failed.load(std::memory_order_relaxed))
+        return;
+
+    RecordHeader h = {};
+    h.kind = kind;
+    h.size = static_cast<uint32_t>(size);
+    h.id = id;
+    h.link = link;
+    h.check = Checksum(h, payload);
+
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _staged.append(reinterpret_cast<const char*>(&h), sizeof(h));
+        _staged.append(payload, size);
+    }
+    _wake.notify_one();
+}
+
+bool JournalLog::_reserve(size_t size)
+{
+    if (size <= _mapped)
+        return true;
+
+    if (!_map)
+        return false;
+
+    size_t grown = _mapped;
+    while (grown < size)
+        grown *= 2;
+    if (ftruncate(_fd, grown) != 0)
+        return false;
+
+    // the records already written are safe in the file, but with the old
+    // mapping gone there is nowhere to put new ones, so logging stops
+    munmap(_map, _mapped);
+    void* map = mmap(nullptr, grown, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (map == MAP_FAILED) {
+        _map = nullptr;
+        _mapped = 0;
+        _failed.store(true);
+        return false;
+    }
+    _map = static_cast<char*>(map);
+    _mapped = grown;
+    return true;
+}
+
+void JournalLog::_run()
+{
+    std::unique_lock<std::mutex> lock(_lock);
+    for (;;) {
+        _wake.wait(lock, [this]() { return _stop || !_staged.empty(); });
+        if (_staged.empty())
+            break;
+
+        _writing.swap(_staged);
+        _busy = true;
+        lock.unlock();
+
+        if (_reserve(_end + _writing.size())) {
+            memcpy(_map + _end, _writing.data(), _writing.size());
+            _end += _writing.size();
+        }
+        _writing.clear();
+
+        lock.lock();
+        _busy = false;
+        _drained.notify_all();
+    }
+}
+
+void JournalLog::Flush()
+{
+    if (_fd < 0)
+        return;
+
+    std::unique_lock<std::mutex> lock(_lock);
+    _drained.wait(lock, [this]() { return _staged.empty() && !_busy; });
+    if (_map)
+        msync(_map, _end, MS_SYNC);
+}
+
+void JournalLog::Appended(const Journal& journal, JournalIndex node)
+{
+    uint64_t id = _next_id++;
+    _set_id(node, id);
+    const JournalNode& n = journal.Node(node);
+    _stage(kRecordAppend, id, _id(n.parent), n.transaction);
+}
+
+void JournalLog::Forked(const Journal& journal, JournalIndex node, JournalIndex from)
+{
+    uint64_t id = _next_id++;
+    _set_id(node, id);
+    _stage(kRecordFork, id, _id(from), journal.Node(node).transaction);
+}
+
+void JournalLog::Merged(const Journal&, JournalIndex node, const Transaction& t)
+{
+    _stage(kRecordMerge, _id(node), 0, t);
+}
+
+void JournalLog::Removed(const Journal&, JournalIndex node)
+{
+    _stage(kRecordRemove, _id(node), 0, nullptr, 0);
+}
+
+void JournalLog::Evicted(const Journal&, JournalIndex node)
+{
+    _stage(kRecordEvict, _id(node), 0, nullptr, 0);
+}
+
+} // lab
@@ -0,0 +1,108 @@
+//
+//  JournalLog.h
+//  LabExcelsior
+//
+//  Copyright © 2023. All rights reserved.
+//
+
+/*
+ JournalLog streams every transaction that enters a Journal to an append
+ only, memory mapped file, so that the history survives the process dying.
+ At startup, Recover rebuilds the journal's tree, forks included, from the
+ file. Removals and evictions are logged too, so history deleted before the
+ process died stays deleted.
+
+ The frame thread only encodes each transaction and appends the bytes to a
+ staging buffer; a writer thread copies staged records into the mapping,
+ growing the file as needed. Records carry a checksum, and recovery stops at
+ the first record that is incomplete or damaged, so a crash mid-write loses
+ at most the records that had not yet reached the mapping.
+
+ The log is POSIX only.
+ */
+
+#ifndef JournalLog_h
+#define JournalLog_h
+
+#include "Modes.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace lab {
+
+class JournalLog : public JournalSink
+{
+    TransactionWriter _write;
+    std::string _scratch;
+
+    int _fd = -1;
+    char* _map = nullptr;
+    size_t _mapped = 0;
+    size_t _end = 0;            // offset just past the last valid record
+    std::atomic<bool> _failed { false };
+
+    // record ids are stable for the life of the log, unlike arena indices,
+    // which are reused. _ids maps a live node's index to its record id.
+    std::vector<uint64_t> _ids;
+    uint64_t _next_id = 1;
+
+    std::mutex _lock;
+    std::condition_variable _wake;
+    std::condition_variable _drained;
+    std::string _staged;        // guarded by _lock
+    std::string _writing;       // owned by the writer thread
+    bool _busy = false;
+    bool _stop = false;
+    std::thread _writer;
+
+    void _stage(uint32_t kind, uint64_t id, uint64_t link, const Transaction& t);
+    void _stage(uint32_t kind, uint64_t id, uint64_t link, const char* payload, size_t size);
+    void _run();
+    bool _reserve(size_t size);
+    size_t _scan() const;
+    uint64_t _id(JournalIndex i) const { return i < _ids.size() ? _ids[i] : 0; }
+    void _set_id(JournalIndex i, uint64_t id);
+
+public:
+    explicit JournalLog(TransactionWriter write);
+    ~JournalLog();
+
+    JournalLog(const JournalLog&) = delete;
+    JournalLog& operator=(const JournalLog&) = delete;
+
+    // opens the log at path, creating it if necessary. Existing records are
+    // kept, and new records are appended after the last valid one.
+    bool Open(const std::string& path);
+
+    // rebuilds the tree recorded in the log into journal, which should be
+    // freshly constructed, and given its budget only afterwards, and leaves
+    // the journal's root current without running any transactions. The
+    // journal's sink is detached while the records are replayed, so that a
+    // journal already logging here does not log its history again. Returns
+    // the node that was current when the log was last written, so the
+    // application can JumpTo it to restore its state. A record the reader
+    // rejects is rebuilt as an empty transaction, so that the shape of the
+    // history is preserved.
+    JournalIndex Recover(Journal& journal, const TransactionReader& read);
+
+    // blocks until every record staged so far is in the mapping, and then
+    // asks the system to write the mapping back to disk
+    void Flush();
+
+    // true once the file could not be remapped to grow it. The records
+    // already written survive, but nothing more is logged.
+    bool Failed() const { return _failed.load(); }
+
+    void Appended(const Journal&, JournalIndex node) override;
+    void Forked(const Journal&, JournalIndex node, JournalIndex from) override;
+    void Merged(const Journal&, JournalIndex node, const Transaction& t) override;
+    void Removed(const Journal&, JournalIndex node) override;
+    void Evicted(const Journal&, JournalIndex node) override;
+};
+
+} // lab
+
+#endif /* JournalLog_h */
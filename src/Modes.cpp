@@ -0,0 +1,2191 @@
+//
+//  Modes.cpp
+//  LabExcelsior
+//
+//  Copyright © 2023. All rights reserved.
+//
+
+#include "Modes.h"
+
+#ifdef LAB_TRANSACTION_QUEUE_MPSC
+#include "TransactionRing.h"
+#else
+#include "concurrentqueue.hpp"
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iterator>
+#include <mutex>
+#include <thread>
+
+namespace lab {
+
+namespace {
+
+// interned message text. The deque never moves its strings, so the views
+// used as keys stay valid as the table grows.
+struct MessageTable {
+    std::mutex lock;
+    std::deque<std::string> text;
+    std::unordered_map<std::string_view, uint32_t> ids;
+};
+
+MessageTable& Messages()
+{
+    static MessageTable table;
+    return table;
+}
+
+} // anon
+
+// each thread remembers the ids of the labels it has interned, keyed by the
+// table's own copies, and the text of the ids it has looked up, so that a
+// label seen before costs no lock either way
+uint32_t TransactionMessage::_intern(std::string_view s)
+{
+    thread_local std::unordered_map<std::string_view, uint32_t> seen;
+    auto hit = seen.find(s);
+    if (hit != seen.end())
+        return hit->second;
+
+    MessageTable& table = Messages();
+    std::lock_guard<std::mutex> lock(table.lock);
+    auto i = table.ids.find(s);
+    if (i == table.ids.end()) {
+        uint32_t id = static_cast<uint32_t>(table.text.size());
+        table.text.emplace_back(s);
+        i = table.ids.emplace(table.text.back(), id).first;
+    }
+    seen.emplace(i->first, i->second);
+    return i->second;
+}
+
+const std::string& TransactionMessage::_interned(uint32_t id)
+{
+    thread_local std::vector<const std::string*> known;
+    if (id < known.size() && known[id])
+        return *known[id];
+
+    MessageTable& table = Messages();
+    const std::string* text;
+    {
+        std::lock_guard<std::mutex> lock(table.lock);
+        text = &table.text[id];
+    }
+    if (id >= known.size())
+        known.resize(id + 1, nullptr);
+    known[id] = text;
+    return *text;
+}
+
+size_t TransactionMessage::InternedCount()
+{
+    MessageTable& table = Messages();
+    std::lock_guard<std::mutex> lock(table.lock);
+    return table.text.size();
+}
+
+std::string TransactionMessage::Str() const
+{
+    switch (_kind) {
+        case Kind::Literal:  return _literal;
+        case Kind::Interned: return _interned(_id);
+        case Kind::Owned:    return *_owned;
+        case Kind::Deferred: return (*_format)();
+        default:             return std::string();
+    }
+}
+
+JournalIndex JournalArena::Allocate()
+{
+    JournalIndex i;
+    if (_free != kJournalNil) {
+        i = _free;
+        _free = (*this)[i].next;
+        (*this)[i].next = kJournalNil;
+    }
+    else {
+        if (_used == _chunks.size() * kChunkSize)
+            _chunks.emplace_back(new JournalNode[kChunkSize]);
+        i = _used++;
+    }
+    ++_live;
+    return i;
+}
+
+void JournalArena::Release(JournalIndex head, JournalIndex tail, uint32_t n)
+{
+    if (head == kJournalNil)
+        return;
+    (*this)[tail].next = _free;
+    _free = head;
+    _live -= n;
+}
+
+Journal::Journal()
+{
+    _root = _nodes.Allocate();
+    _nodes[_root].branch = _branch_new(kJournalNil, _root);
+    _bytes = RetainedBytes(_root);
+    _stat_node(_root, true);
+    _set_current(_root);
+    _publish();
+}
+
+void Journal::_set_current(JournalIndex node)
+{
+    _curr = node;
+    _nodes[node].visited = ++_clock;
+}
+
+size_t Journal::RetainedBytes(JournalIndex node) const
+{
+    const Transaction& t = _nodes[node].transaction;
+    size_t bytes = sizeof(JournalNode) + t.retained;
+    bytes += t.message.HeapBytes() + t.exec.HeapBytes() + t.undo.HeapBytes();
+    return bytes;
+}
+
+// visits head and everything after it, but not head's siblings. The walk
+// follows the parent links back up rather than keeping a stack.
+template <typename F>
+void Journal::_walk(JournalIndex head, F&& visit) const
+{
+    JournalIndex i = head;
+    for (;;) {
+        visit(i);
+        if (_nodes[i].next != kJournalNil) {
+            i = _nodes[i].next;
+            continue;
+        }
+        while (i != head && _nodes[i].sibling == kJournalNil)
+            i = _nodes[i].parent;
+        if (i == head)
+            break;
+        i = _nodes[i].sibling;
+    }
+}
+
+bool Journal::Validate()
+{
+    uint32_t total = 0;
+    _walk(_root, [&total](JournalIndex) { ++total; });
+    if (total != _nodes.Live())
+        return false;
+
+#if LAB_JOURNAL_STATS
+    uint32_t counted = 0;
+    for (uint32_t n : _fanout)
+        counted += n;
+    if (counted != total)
+        return false;
+#endif
+
+    uint32_t branches = 0;
+    ForEachBranch([&branches](JournalBranchId, const JournalBranch&) { ++branches; });
+    return branches == _branches.size() - _free_branches.size();
+}
+
+#if LAB_JOURNAL_STATS
+void Journal::_stat_node(JournalIndex node, bool added)
+{
+    uint32_t& c = _nodes[node].children;
+    if (added) {
+        c = 0;
+        if (_fanout.empty())
+            _fanout.resize(1, 0);
+        ++_fanout[0];
+        return;
+    }
+    --_fanout[c];
+    c = 0;
+    while (_max_fanout && !_fanout[_max_fanout])
+        --_max_fanout;
+}
+
+void Journal::_stat_children(JournalIndex node, uint32_t children)
+{
+    uint32_t& c = _nodes[node].children;
+    --_fanout[c];
+    if (children >= _fanout.size())
+        _fanout.resize(children + 1, 0);
+    ++_fanout[children];
+    c = children;
+    if (children > _max_fanout)
+        _max_fanout = children;
+    while (_max_fanout && !_fanout[_max_fanout])
+        --_max_fanout;
+}
+
+void Journal::_publish()
+{
+    _stat_nodes.store(_nodes.Live(), std::memory_order_relaxed);
+    _stat_bytes.store(_bytes, std::memory_order_relaxed);
+    _stat_depth.store(_nodes[_curr].depth - _nodes[_root].depth, std::memory_order_relaxed);
+    _stat_branches.store(static_cast<uint32_t>(_branches.size() - _free_branches.size()),
+                         std::memory_order_relaxed);
+    _stat_leaves.store(_fanout[0], std::memory_order_relaxed);
+    _stat_max_fanout.store(_max_fanout, std::memory_order_relaxed);
+}
+
+JournalStats Journal::Stats() const
+{
+    JournalStats stats;
+    stats.nodes = _stat_nodes.load(std::memory_order_relaxed);
+    stats.bytes = _stat_bytes.load(std::memory_order_relaxed);
+    stats.depth = _stat_depth.load(std::memory_order_relaxed);
+    stats.branches = _stat_branches.load(std::memory_order_relaxed);
+    stats.leaves = _stat_leaves.load(std::memory_order_relaxed);
+    stats.max_fanout = _stat_max_fanout.load(std::memory_order_relaxed);
+    return stats;
+}
+#else
+JournalStats Journal::Stats() const
+{
+    return JournalStats();
+}
+#endif
+
+JournalBranchId Journal::_branch_new(JournalIndex fork_point, JournalIndex head)
+{
+    JournalBranchId id;
+    if (!_free_branches.empty()) {
+        id = _free_branches.back();
+        _free_branches.pop_back();
+    }
+    else {
+        id = static_cast<JournalBranchId>(_branches.size());
+        _branches.emplace_back();
+    }
+    JournalBranch& b = _branches[id];
+    b.fork_point = fork_point;
+    b.head = head;
+    b.tip = head;
+    return id;
+}
+
+// called as node is released; if node heads its branch, the branch goes too
+void Journal::_branch_release(JournalIndex node)
+{
+    if (!_forks.empty())
+        _forks.erase(node);
+
+    JournalBranchId id = _nodes[node].branch;
+    JournalBranch& b = _branches[id];
+    if (b.head != node)
+        return;
+
+    auto forks = _forks.find(b.fork_point);
+    if (forks != _forks.end()) {
+        auto& ids = forks->second;
+        auto i = std::find(ids.begin(), ids.end(), id);
+        if (i != ids.end())
+            ids.erase(i);
+        if (ids.empty())
+            _forks.erase(forks);
+    }
+    b = JournalBranch();
+    _free_branches.push_back(id);
+}
+
+// called as node is cut from its parent; if the parent is on the same branch,
+// the parent becomes the branch's tip
+void Journal::_branch_cut(JournalIndex node)
+{
+    JournalBranch& b = _branches[_nodes[node].branch];
+    if (b.head != node)
+        b.tip = _nodes[node].parent;
+}
+
+const std::vector<JournalBranchId>& Journal::Branches(JournalIndex fork_point) const
+{
+    static const std::vector<JournalBranchId> none;
+    auto forks = _forks.find(fork_point);
+    return forks == _forks.end() ? none : forks->second;
+}
+
+// gathers first, its siblings, and everything after them onto a list
+// threaded through next, releasing the transactions along the way. The walk
+// never recurses: nodes still to be visited are chained through their
+// sibling links, so a million node chain takes no more stack than a single
+// node does. Returns the number of nodes gathered.
+uint32_t Journal::_collect(JournalIndex first, JournalIndex& head, JournalIndex& tail)
+{
+    uint32_t n = 0;
+    JournalIndex work = first;
+    while (work != kJournalNil) {
+        JournalIndex i = work;
+        JournalNode& jn = _nodes[i];
+        work = jn.sibling;
+
+        // the children are already chained by sibling, so splice the whole
+        // chain onto the front of the work list
+        JournalIndex c = jn.next;
+        if (c != kJournalNil) {
+            JournalIndex last = c;
+            while (_nodes[last].sibling != kJournalNil)
+                last = _nodes[last].sibling;
+            _nodes[last].sibling = work;
+            work = c;
+        }
+
+        _bytes -= RetainedBytes(i);
+        _stat_node(i, false);
+        _branch_release(i);
+        if (i == _redo_tip)
+            _redo_tip = kJournalNil;
+        if (_checkpoint_interval)
+            _checkpoints.erase(i);
+        jn.transaction = Transaction();
+        jn.sibling = kJournalNil;
+        jn.parent = kJournalNil;
+        jn.next = head;
+        head = i;
+        if (tail == kJournalNil)
+            tail = i;
+        ++n;
+    }
+    return n;
+}
+
+void Journal::_release_subtree(JournalIndex node)
+{
+    JournalIndex head = kJournalNil, tail = kJournalNil;
+    _nodes[node].sibling = kJournalNil;
+    uint32_t n = _collect(node, head, tail);
+    _nodes.Release(head, tail, n);
+}
+
+void Journal::Truncate(JournalIndex node)
+{
+    if (_sink)
+        for (JournalIndex c = _nodes[node].next; c != kJournalNil; c = _nodes[c].sibling)
+            _sink->Removed(*this, c);
+    _truncate(node);
+}
+
+// appending truncates too, but a sink sees the append, which implies it
+void Journal::_truncate(JournalIndex node)
+{
+    // if the current node is about to go, the truncation point becomes current
+    for (JournalIndex i = _curr; i != kJournalNil; i = _nodes[i].parent) {
+        if (i == node) {
+            _set_current(node);
+            break;
+        }
+    }
+
+    JournalIndex head = kJournalNil, tail = kJournalNil;
+    uint32_t n = _collect(_nodes[node].next, head, tail);
+    _nodes[node].next = kJournalNil;
+    _nodes.Release(head, tail, n);
+    _branches[_nodes[node].branch].tip = node;
+    _stat_children(node, 0);
+    _publish();
+}
+
+static int64_t MonotonicNanoseconds()
+{
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void Journal::SetMergeWindow(double seconds)
+{
+    _merge_window_ns = static_cast<int64_t>(seconds * 1e9);
+}
+
+// folds t into the current node if they share a merge key and t arrives in
+// the merge window or continues a merge
+bool Journal::_merge(Transaction& t)
+{
+    if (!t.merge_key)
+        return false;
+
+    int64_t now = MonotonicNanoseconds();
+    int64_t last = _merge_last_ns;
+    _merge_last_ns = now;
+
+    if (_curr == _root || _nodes[_curr].transaction.merge_key != t.merge_key)
+        return false;
+    bool in_window = _merge_window_ns > 0 && now - last <= _merge_window_ns;
+    if (!t.merge_continues && !in_window)
+        return false;
+
+    _fold(t);
+    return true;
+}
+
+// the current node keeps its undo, which restores the state from before the
+// first merged transaction, and takes t's exec, which applies the state after
+// the last
+void Journal::_fold(Transaction& t)
+{
+    JournalIndex from = _curr;
+    if (_sink)
+        _sink->Merged(*this, _curr, t);
+
+    _truncate(_curr);
+    Transaction& curr = _nodes[_curr].transaction;
+    _bytes -= RetainedBytes(_curr);
+    curr.exec = std::move(t.exec);
+    curr.retained = std::max(curr.retained, t.retained);
+    _bytes += RetainedBytes(_curr);
+    _set_current(_curr);
+    _checkpoint(_curr);
+    _notify(from, 0, 0, 0, 1);
+    _publish();
+}
+
+void Journal::Merge(Transaction&& t)
+{
+    if (_curr == _root)
+        Append(std::move(t));
+    else
+        _fold(t);
+}
+
+void Journal::Append(Transaction&& t)
+{
+    if (_merge(t))
+        return;
+
+    JournalIndex from = _curr;
+    _truncate(_curr);
+    JournalIndex n = _nodes.Allocate();
+    JournalNode& jn = _nodes[n];
+    jn.transaction = std::move(t);
+    jn.parent = _curr;
+    jn.depth = _nodes[_curr].depth + 1;
+    jn.branch = _nodes[_curr].branch;
+    _branches[jn.branch].tip = n;
+    _nodes[_curr].next = n;
+    _stat_node(n, true);
+    _stat_children(_curr, 1);
+    _bytes += RetainedBytes(n);
+    _set_current(n);
+    _checkpoint(n);
+    if (_sink)
+        _sink->Appended(*this, n);
+    if (_budget_bytes || _budget_nodes)
+        Trim();
+    _redo_tip = kJournalNil;
+    _notify(from, 0, 0, 1, 0);
+    _publish();
+}
+
+void Journal::Fork(Transaction&& t)
+{
+    // the root has no parent to hang a sibling from
+    if (_curr == _root) {
+        Append(std::move(t));
+        return;
+    }
+
+    JournalIndex n = _nodes.Allocate();
+    JournalNode& jn = _nodes[n];
+    jn.transaction = std::move(t);
+    jn.parent = _nodes[_curr].parent;
+    jn.depth = _nodes[_curr].depth;
+
+    // the most recently forked branch's head ends the list of children, so
+    // the new head is linked without walking the siblings
+    jn.branch = _branch_new(jn.parent, n);
+    auto& forks = _forks[jn.parent];
+    JournalIndex last = forks.empty() ? _nodes[jn.parent].next : _branches[forks.back()].head;
+    forks.push_back(jn.branch);
+    _nodes[last].sibling = n;
+    _stat_node(n, true);
+    _stat_adopt(jn.parent, 1);
+    _bytes += RetainedBytes(n);
+    JournalIndex from = _curr;
+    _set_current(n);
+    _checkpoint(n);
+    if (_sink)
+        _sink->Forked(*this, n, from);
+    if (_budget_bytes || _budget_nodes)
+        Trim();
+    _redo_tip = kJournalNil;
+    _notify(from, 0, 0, 1, 0);
+    _publish();
+}
+
+// detaches node from its parent's list of children
+void Journal::_unlink(JournalIndex node)
+{
+    _branch_cut(node);
+    JournalIndex parent = _nodes[node].parent;
+    JournalNode& p = _nodes[parent];
+    if (p.next == node) {
+        p.next = _nodes[node].sibling;
+        _stat_adopt(parent, -1);
+        return;
+    }
+    JournalIndex prev = p.next;
+    while (prev != kJournalNil && _nodes[prev].sibling != node)
+        prev = _nodes[prev].sibling;
+    if (prev != kJournalNil) {
+        _nodes[prev].sibling = _nodes[node].sibling;
+        _stat_adopt(parent, -1);
+    }
+}
+
+void Journal::Remove(JournalIndex node)
+{
+    if (node == _root || node == kJournalNil)
+        return;
+
+    if (_sink)
+        _sink->Removed(*this, node);
+    JournalIndex parent = _nodes[node].parent;
+    _unlink(node);
+
+    for (JournalIndex i = _curr; i != kJournalNil; i = _nodes[i].parent) {
+        if (i == node) {
+            _set_current(parent);
+            break;
+        }
+    }
+
+    _release_subtree(node);
+    _publish();
+}
+
+// the most recent visit to any node in the subtree rooted at head
+uint32_t Journal::_recency(JournalIndex head) const
+{
+    uint32_t recent = 0;
+    _walk(head, [this, &recent](JournalIndex i) {
+        recent = std::max(recent, _nodes[i].visited);
+    });
+    return recent;
+}
+
+bool Journal::_over_budget(size_t bytes, uint32_t nodes) const
+{
+    return (_budget_bytes && _bytes > bytes) || (_budget_nodes && _nodes.Live() > nodes);
+}
+
+void Journal::SetBudget(size_t max_bytes, uint32_t max_nodes)
+{
+    _budget_bytes = max_bytes;
+    _budget_nodes = max_nodes;
+    Trim();
+}
+
+void Journal::Trim()
+{
+    if (!_over_budget(_budget_bytes, _budget_nodes))
+        return;
+
+    const size_t bytes = _budget_bytes - _budget_bytes / 8;
+    const uint32_t nodes = _budget_nodes - _budget_nodes / 8;
+
+    // every child of a node on the path from the root to the current node
+    // that is not itself on that path heads a branch that can go
+    _candidates.clear();
+    JournalIndex on = kJournalNil;
+    for (JournalIndex p = _curr; p != kJournalNil; on = p, p = _nodes[p].parent) {
+        for (JournalIndex c = _nodes[p].next; c != kJournalNil; c = _nodes[c].sibling) {
+            if (c != on)
+                _candidates.push_back({ c, _recency(c) });
+        }
+    }
+    std::sort(_candidates.begin(), _candidates.end(),
+              [](const EvictionCandidate& a, const EvictionCandidate& b) {
+                  return a.visited < b.visited;
+              });
+    for (const EvictionCandidate& c : _candidates) {
+        if (!_over_budget(bytes, nodes)) {
+            _publish();
+            return;
+        }
+        if (_sink)
+            _sink->Removed(*this, c.head);
+        _unlink(c.head);
+        _release_subtree(c.head);
+    }
+
+    // only the chain from the root to the current node remains, so drop
+    // its oldest nodes, letting the root stand in for the oldest state left
+    while (_over_budget(bytes, nodes)) {
+        JournalIndex oldest = _nodes[_root].next;
+        if (oldest == kJournalNil || oldest == _curr)
+            break;
+        _evict_oldest();
+    }
+    _publish();
+}
+
+bool Journal::EvictOldest()
+{
+    JournalIndex oldest = _nodes[_root].next;
+    if (oldest == kJournalNil || _nodes[oldest].sibling != kJournalNil)
+        return false;
+    JournalIndex next = _nodes[oldest].next;
+    if (next != kJournalNil && _nodes[next].sibling != kJournalNil)
+        return false;
+    if (oldest == _curr)
+        _set_current(_root);
+    _evict_oldest();
+    _publish();
+    return true;
+}
+
+// the root absorbs its only child, and stands for the state after it
+void Journal::_evict_oldest()
+{
+    JournalIndex oldest = _nodes[_root].next;
+    if (_sink)
+        _sink->Evicted(*this, oldest);
+    JournalIndex next = _nodes[oldest].next;
+    _nodes[_root].next = next;
+    uint32_t children = 0;
+    for (JournalIndex c = next; c != kJournalNil; c = _nodes[c].sibling, ++children)
+        _nodes[c].parent = _root;
+    _stat_children(_root, children);
+    _nodes[_root].depth = _nodes[oldest].depth;
+
+    // the root joins oldest's branch, and heads it
+    JournalBranchId rb = _nodes[_root].branch;
+    JournalBranchId ob = _nodes[oldest].branch;
+    if (rb != ob) {
+        _branches[rb] = JournalBranch();
+        _free_branches.push_back(rb);
+        _forks.erase(_root);
+        _nodes[_root].branch = ob;
+    }
+    _branches[ob].fork_point = kJournalNil;
+    _branches[ob].head = _root;
+    if (_branches[ob].tip == oldest)
+        _branches[ob].tip = _root;
+
+    // branches forked from oldest are now forked from the root
+    auto forks = _forks.find(oldest);
+    if (forks != _forks.end()) {
+        std::vector<JournalBranchId> ids = std::move(forks->second);
+        _forks.erase(forks);
+        for (JournalBranchId id : ids)
+            _branches[id].fork_point = _root;
+        _forks[_root] = std::move(ids);
+    }
+
+    if (_checkpoint_interval) {
+        // the root now stands for the state after oldest
+        auto cp = _checkpoints.find(oldest);
+        if (cp != _checkpoints.end())
+            _checkpoints[_root] = std::move(cp->second);
+        else
+            _checkpoints.erase(_root);
+    }
+    _nodes[oldest].next = kJournalNil;
+    _stat_children(oldest, 0);
+    _release_subtree(oldest);
+}
+
+void Journal::SetCheckpoints(uint32_t interval, SnapshotFn snapshot, RestoreFn restore)
+{
+    _checkpoints.clear();
+    _checkpoint_interval = interval;
+    _snapshot = interval ? std::move(snapshot) : nullptr;
+    _restore = interval ? std::move(restore) : nullptr;
+    if (_checkpoint_interval && _curr == _root)
+        _checkpoints[_root] = _snapshot();
+}
+
+void Journal::_checkpoint(JournalIndex node)
+{
+    if (_checkpoint_interval && _nodes[node].depth % _checkpoint_interval == 0)
+        _checkpoints[node] = _snapshot();
+}
+
+JournalIndex Journal::_common_ancestor(JournalIndex a, JournalIndex b) const
+{
+    while (_nodes[a].depth > _nodes[b].depth)
+        a = _nodes[a].parent;
+    while (_nodes[b].depth > _nodes[a].depth)
+        b = _nodes[b].parent;
+    while (a != b) {
+        a = _nodes[a].parent;
+        b = _nodes[b].parent;
+    }
+    return a;
+}
+
+void Journal::JumpTo(JournalIndex node)
+{
+    if (node == _curr || node == kJournalNil)
+        return;
+
+    JournalIndex prev = _curr;
+    JournalIndex common = _common_ancestor(_curr, node);
+    uint32_t undos = _nodes[_curr].depth - _nodes[common].depth;
+    uint32_t redos = _nodes[node].depth - _nodes[common].depth;
+    uint32_t cost = undos + redos;
+
+    // look for a checkpoint at or above node that is closer than walking
+    JournalIndex from = kJournalNil;
+    if (_checkpoint_interval) {
+        uint32_t steps = 0;
+        for (JournalIndex i = node; i != kJournalNil && steps < cost; i = _nodes[i].parent, ++steps) {
+            auto cp = _checkpoints.find(i);
+            if (cp != _checkpoints.end()) {
+                from = i;
+                _restore(cp->second);
+                break;
+            }
+        }
+    }
+
+    if (from == kJournalNil) {
+        for (JournalIndex i = _curr; i != common; i = _nodes[i].parent) {
+            auto& undo = _nodes[i].transaction.undo;
+            if (undo)
+                undo();
+        }
+        from = common;
+    }
+
+    // replay forward from the restored or common node
+    _path.clear();
+    for (JournalIndex i = node; i != from; i = _nodes[i].parent)
+        _path.push_back(i);
+    for (auto i = _path.rbegin(); i != _path.rend(); ++i) {
+        auto& exec = _nodes[*i].transaction.exec;
+        if (exec)
+            exec();
+    }
+
+    _set_current(node);
+
+    // keep the furthest point undone from, so Redo can find its way back
+    if (_redo_tip == kJournalNil || !_is_ancestor(node, _redo_tip))
+        _redo_tip = _is_ancestor(node, prev) ? prev : kJournalNil;
+
+    _notify(prev, undos, redos, 0, 0);
+    _publish();
+}
+
+bool Journal::_is_ancestor(JournalIndex ancestor, JournalIndex node) const
+{
+    uint32_t depth = _nodes[ancestor].depth;
+    while (node != kJournalNil && _nodes[node].depth > depth)
+        node = _nodes[node].parent;
+    return node == ancestor;
+}
+
+// the child that continues node's branch, or failing that, the first child
+JournalIndex Journal::_redo_child(JournalIndex node) const
+{
+    uint32_t branch = _nodes[node].branch;
+    for (JournalIndex c = _nodes[node].next; c != kJournalNil; c = _nodes[c].sibling)
+        if (_nodes[c].branch == branch)
+            return c;
+    return _nodes[node].next;
+}
+
+uint32_t Journal::Undo(uint32_t steps)
+{
+    JournalIndex target = _curr;
+    uint32_t taken = 0;
+    while (taken < steps && target != _root) {
+        target = _nodes[target].parent;
+        ++taken;
+    }
+    JumpTo(target);
+    return taken;
+}
+
+uint32_t Journal::Redo(uint32_t steps)
+{
+    JournalIndex target = _curr;
+    uint32_t taken = 0;
+    if (_redo_tip != kJournalNil && _redo_tip != _curr && _is_ancestor(_curr, _redo_tip)) {
+        uint32_t available = _nodes[_redo_tip].depth - _nodes[_curr].depth;
+        taken = std::min(steps, available);
+        target = _redo_tip;
+        for (uint32_t i = taken; i < available; ++i)
+            target = _nodes[target].parent;
+    }
+    else {
+        for (JournalIndex c; taken < steps && (c = _redo_child(target)) != kJournalNil; ++taken)
+            target = c;
+    }
+    JumpTo(target);
+    return taken;
+}
+
+uint32_t Journal::AddChangeListener(ChangeListener listener)
+{
+    uint32_t id = _next_listener++;
+    _listeners.emplace_back(id, std::move(listener));
+    return id;
+}
+
+void Journal::RemoveChangeListener(uint32_t id)
+{
+    for (auto i = _listeners.begin(); i != _listeners.end(); ++i) {
+        if (i->first == id) {
+            _listeners.erase(i);
+            return;
+        }
+    }
+}
+
+void Journal::_notify(JournalIndex from, uint32_t undone, uint32_t redone,
+                      uint32_t appended, uint32_t merged)
+{
+    if (_listeners.empty())
+        return;
+
+    if (!_change_pending) {
+        _change = JournalChange();
+        _change.from = from;
+        _change_pending = true;
+    }
+    _change.to = _curr;
+    _change.undone += undone;
+    _change.redone += redone;
+    _change.appended += appended;
+    _change.merged += merged;
+
+    if (!_batch_depth)
+        _flush_change();
+}
+
+void Journal::_flush_change()
+{
+    JournalChange change = _change;
+    _change_pending = false;
+    for (auto& listener : _listeners)
+        listener.second(change);
+}
+
+void Journal::EndBatch()
+{
+    if (_batch_depth && !--_batch_depth && _change_pending)
+        _flush_change();
+}
+
+//-----------------------------------------------------------------------------
+// ModeManager
+
+namespace {
+
+ModeManager* gCanonical = nullptr;
+
+#ifdef LAB_TRANSACTION_QUEUE_MPSC
+using TransactionQueue = TransactionRing<Transaction>;
+#else
+using TransactionQueue = moodycamel::ConcurrentQueue<Transaction>;
+#endif
+
+// a group of transactions being gathered on the current thread
+struct TransactionGroup {
+    ModeManager* manager;
+    uint32_t depth;
+    TransactionLane lane;
+    TransactionMessage message;
+    std::vector<Transaction> batch;
+};
+
+thread_local std::vector<TransactionGroup> tGroups;
+
+// the manager whose frame the thread is executing transactions for, if it is
+// a worker doing so; its enqueues are admitted as the frame thread's are,
+// since the frame thread is waiting for it
+thread_local const void* tExecuting = nullptr;
+
+// the address identifies the thread's implicit producer to the overflow slots
+thread_local char tImplicitProducer;
+
+// shared by a manager and its completions, so that a completion can be
+// waited on without keeping the manager alive
+struct CompletionSignal {
+    std::mutex lock;
+    std::condition_variable resolved;
+    std::atomic<uint32_t> waiters { 0 };
+};
+
+// runs a function over a range of indices on a set of threads, with the
+// calling thread pitching in
+class WorkerPool
+{
+    std::vector<std::thread> _threads;
+    std::mutex _lock;
+    std::condition_variable _wake;
+    std::condition_variable _done;
+    void (*_fn)(void*, size_t) = nullptr;
+    void* _ctx = nullptr;
+    std::atomic<size_t> _next { 0 };
+    size_t _count = 0;
+    size_t _busy = 0;           // workers yet to finish the current job
+    uint64_t _generation = 0;
+    bool _stop = false;
+
+    void _work()
+    {
+        for (size_t i; (i = _next.fetch_add(1, std::memory_order_relaxed)) < _count; )
+            _fn(_ctx, i);
+    }
+
+    void _run()
+    {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> lock(_lock);
+        for (;;) {
+            _wake.wait(lock, [&]() { return _stop || _generation != seen; });
+            if (_stop)
+                return;
+            seen = _generation;
+            lock.unlock();
+            _work();
+            lock.lock();
+            if (!--_busy)
+                _done.notify_one();
+        }
+    }
+
+public:
+    explicit WorkerPool(unsigned count)
+    {
+        for (unsigned i = 0; i < count; ++i)
+            _threads.emplace_back([this]() { _run(); });
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            _stop = true;
+        }
+        _wake.notify_all();
+        for (auto& t : _threads)
+            t.join();
+    }
+
+    template <typename F>
+    void For(size_t count, F& fn)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            _fn = [](void* ctx, size_t i) { (*static_cast<F*>(ctx))(i); };
+            _ctx = &fn;
+            _next.store(0, std::memory_order_relaxed);
+            _count = count;
+            _busy = _threads.size();
+            ++_generation;
+        }
+        _wake.notify_all();
+        _work();
+        std::unique_lock<std::mutex> lock(_lock);
+        _done.wait(lock, [this]() { return !_busy; });
+    }
+};
+
+TransactionGroup* OpenGroup(ModeManager* mm)
+{
+    for (auto& g : tGroups)
+        if (g.manager == mm)
+            return &g;
+    return nullptr;
+}
+
+} // anon
+
+struct TransactionCompletionState
+{
+    std::atomic<bool> done { false };
+    std::atomic<bool> refused { false };
+    std::shared_ptr<CompletionSignal> signal;
+    // resolved along with this. The list is kept flat, never holding a
+    // state with a list of its own, so that freeing a group of any size
+    // takes no deeper recursion than freeing one.
+    std::vector<std::shared_ptr<TransactionCompletionState>> also;
+};
+
+namespace {
+
+// makes from, and everything resolved along with it, resolve along with into
+void Chain(std::shared_ptr<TransactionCompletionState>& into,
+           std::shared_ptr<TransactionCompletionState> from)
+{
+    if (!from)
+        return;
+    if (!into) {
+        into = std::move(from);
+        return;
+    }
+    std::vector<std::shared_ptr<TransactionCompletionState>>& also = into->also;
+    for (auto& s : from->also)
+        also.push_back(std::move(s));
+    from->also.clear();
+    also.push_back(std::move(from));
+}
+
+// calls fn on c and on everything resolved along with it
+template <typename F>
+void ForEachCompletion(TransactionCompletionState* c, F&& fn)
+{
+    if (!c)
+        return;
+    fn(*c);
+    for (auto& s : c->also)
+        fn(*s);
+}
+
+} // anon
+
+bool TransactionCompletion::Ready() const
+{
+    return !_state || _state->done.load();
+}
+
+bool TransactionCompletion::Refused() const
+{
+    return _state && _state->refused.load();
+}
+
+void TransactionCompletion::Wait() const
+{
+    if (Ready())
+        return;
+    CompletionSignal& s = *_state->signal;
+    s.waiters.fetch_add(1);
+    {
+        std::unique_lock<std::mutex> lock(s.lock);
+        s.resolved.wait(lock, [this]() { return _state->done.load(); });
+    }
+    s.waiters.fetch_sub(1);
+}
+
+bool TransactionCompletion::WaitFor(double seconds) const
+{
+    if (Ready())
+        return true;
+    CompletionSignal& s = *_state->signal;
+    s.waiters.fetch_add(1);
+    bool done;
+    {
+        std::unique_lock<std::mutex> lock(s.lock);
+        done = s.resolved.wait_for(lock, std::chrono::duration<double>(seconds),
+                                   [this]() { return _state->done.load(); });
+    }
+    s.waiters.fetch_sub(1);
+    return done;
+}
+
+struct ModeManager::data
+{
+    // the registries, indexed by handle, and the handles by ModeNameId
+    template <typename T>
+    struct Registry {
+        std::vector<std::string> names;
+        std::vector<std::function<std::shared_ptr<T>()>> factories;
+        std::unordered_map<uint64_t, uint32_t> ids;
+
+        uint32_t Register(const std::string& name, std::function<std::shared_ptr<T>()> fn);
+    };
+    struct MajorModeRecord {
+        std::string name;
+        std::shared_ptr<MajorMode> instance;
+    };
+    Registry<Activity> activity_registry;
+    std::vector<ActivityRecord> activity_records;
+    Registry<MajorMode> major_mode_registry;
+    std::vector<MajorModeRecord> major_mode_records;
+    std::shared_ptr<MajorMode> major_mode;
+    uint64_t activities_generation = 0;
+
+    // the handle indices of the active activities, in registration order
+    std::vector<uint32_t> active;
+    std::shared_ptr<Activity> hover_owner;
+    std::shared_ptr<Activity> drag_owner;
+
+    // activities whose activation has changed since active was last patched
+    std::vector<uint32_t> dirty;
+    std::vector<uint8_t> is_dirty;
+
+    // for each callback, the active activities that implement it, in the
+    // same order as active, so that dispatch is a loop with no tests
+    template <typename F>
+    struct Call {
+        F fn;
+        void* self;
+        uint32_t index;     // the activity's handle index
+    };
+    using Callback = void (*)(void*);
+    using ViewCallback = void (*)(void*, const LabViewInteraction*);
+    using BidCallback = int (*)(void*, const LabViewInteraction*);
+    std::vector<Call<Callback>> update_calls;
+    std::vector<Call<Callback>> menu_calls;
+    std::vector<Call<ViewCallback>> render_calls;
+    std::vector<Call<ViewCallback>> ui_calls;
+    std::vector<Call<BidCallback>> hover_bids;
+    std::vector<Call<BidCallback>> drag_bids;
+
+    void Mark(uint32_t index);
+    void Patch();
+    void Insert(uint32_t index);
+    void Erase(uint32_t index);
+    std::shared_ptr<Activity> Auction(const std::vector<Call<BidCallback>>& bids,
+                                      const LabViewInteraction& vi) const;
+
+    // a queue per TransactionLane, each with the frame thread's consumer token
+    struct Lane {
+        TransactionQueue queue;
+        TransactionQueue::consumer_token_t consumer { queue };
+    };
+    Lane lanes[kTransactionLaneCount];
+    size_t background_quota = 1024;
+
+    // the per frame budget, a running estimate of the cost of a transaction,
+    // and the state of the queue at the end of the last frame
+    int64_t budget_ns = 0;
+    double ns_per_transaction = 0;
+    TransactionBacklog backlog;
+
+    std::atomic<TransactionTap*> tap { nullptr };
+
+    // the capacity and the queue's counters. Producers touch only depth on
+    // the common path, and only while there is a capacity to enforce; an
+    // unbounded queue's depth is read from the lanes instead, and its high
+    // water sampled once a frame. enqueued is derived from depth and dequeued.
+    std::atomic<size_t> capacity { 0 };
+    std::atomic<TransactionOverflow> overflow { TransactionOverflow::Block };
+    std::atomic<int64_t> depth { 0 };
+    std::atomic<size_t> high_water { 0 };
+    std::atomic<uint64_t> dequeued { 0 };
+    std::atomic<uint64_t> rejected { 0 };
+    std::atomic<uint64_t> coalesced { 0 };
+    std::atomic<uint64_t> blocked { 0 };
+    std::atomic<std::thread::id> frame_thread;
+
+    // producers blocked for room wait here, and are woken once per frame
+    std::mutex room_lock;
+    std::condition_variable room;
+    std::atomic<uint32_t> room_waiters { 0 };
+
+    // the DropOldestMergeable overflow slots, by merge key, numbered in the
+    // order they were made, each with the producer of the transaction last
+    // folded into it
+    struct Slot {
+        TransactionLane lane;
+        Transaction transaction;
+        uint64_t serial;
+        const void* producer;
+    };
+    std::mutex overflow_lock;
+    std::unordered_map<uint64_t, Slot> overflow_slots;
+    std::atomic<uint32_t> overflowing { 0 };
+    uint64_t slot_serial = 0;
+
+    // moves producer's overflow slots on lane into the queue through
+    // enqueue(transaction), oldest first. A producer does so ahead of each
+    // transaction it enqueues, which would otherwise overtake them; handing
+    // them to any other producer would lose their place behind its own.
+    template <typename F>
+    void FlushSlots(TransactionLane lane, const void* producer, F&& enqueue) {
+        if (!overflowing.load())
+            return;
+        std::lock_guard<std::mutex> lock(overflow_lock);
+        std::vector<std::unordered_map<uint64_t, Slot>::iterator> slots;
+        for (auto i = overflow_slots.begin(); i != overflow_slots.end(); ++i)
+            if (i->second.lane == lane && i->second.producer == producer)
+                slots.push_back(i);
+        std::sort(slots.begin(), slots.end(), [](const auto& a, const auto& b) {
+            return a->second.serial < b->second.serial;
+        });
+        for (auto i : slots) {
+            depth.fetch_add(1);
+            enqueue(std::move(i->second.transaction));
+            overflow_slots.erase(i);
+        }
+        overflowing.store(static_cast<uint32_t>(overflow_slots.size()));
+    }
+
+    // completions of the frame's transactions, resolved together at its end
+    std::shared_ptr<CompletionSignal> signal = std::make_shared<CompletionSignal>();
+    std::vector<std::shared_ptr<TransactionCompletionState>> completed;
+
+    TransactionQueue& Queue(TransactionLane lane) {
+        return lanes[static_cast<size_t>(lane)].queue;
+    }
+
+    // enqueues an admitted transaction on the thread's implicit producer,
+    // behind the thread's overflow slots on its lane
+    void Enqueue(TransactionLane lane, Transaction&& t) {
+        TransactionQueue& queue = Queue(lane);
+        FlushSlots(lane, &tImplicitProducer, [&queue](Transaction&& s) { queue.enqueue(std::move(s)); });
+        queue.enqueue(std::move(t));
+    }
+
+    // the transactions waiting in the lanes and the overflow slots
+    size_t Queued() const {
+        size_t n = overflowing.load();
+        for (auto& l : lanes)
+            n += l.queue.size_approx();
+        return n;
+    }
+    void NoteHighWater(size_t d) {
+        size_t hw = high_water.load(std::memory_order_relaxed);
+        while (d > hw && !high_water.compare_exchange_weak(hw, d, std::memory_order_relaxed))
+            ;
+    }
+
+    // the frame's transactions are bulk dequeued into drained, which keeps
+    // its size from frame to frame so the slots are reused rather than
+    // reallocated
+    static constexpr size_t kDrainChunk = 256;
+    static constexpr size_t kProbeSlice = 16;
+    std::vector<Transaction> drained = std::vector<Transaction>(kDrainChunk);
+
+    // the schedule of the frame's transactions across the workers
+    std::unique_ptr<WorkerPool> workers;
+    std::unordered_map<uint64_t, uint32_t> last_wave;
+    std::vector<uint32_t> wave;
+    std::vector<uint32_t> wave_start;
+    std::vector<uint32_t> order;
+
+    enum class Admission { Queue, Coalesced, Rejected };
+    Admission Admit(Transaction* t, size_t n, TransactionLane lane, const void* producer);
+    bool Coalesce(Transaction& t, TransactionLane lane, const void* producer, bool create);
+    void Refuse(Transaction* t, size_t n);
+    void Drained(size_t n);
+    size_t TakeOverflow();
+
+    size_t Drain(Lane& lane, size_t n, size_t limit);
+    void Execute(Transaction* batch, size_t count);
+};
+
+// decides whether n transactions, about to be enqueued on lane by producer,
+// may join the queue, and if so, while the queue is bounded, counts them in
+// its depth. A single mergeable transaction may instead be folded into an
+// overflow slot.
+ModeManager::data::Admission ModeManager::data::Admit(Transaction* t, size_t n, TransactionLane lane,
+                                                      const void* producer)
+{
+    // once a key has a slot, later transactions with the key must follow it
+    if (n == 1 && t->merge_key && overflowing.load() && Coalesce(*t, lane, producer, false))
+        return Admission::Coalesced;
+
+    // a batch larger than the capacity could never fit, so it is let in
+    // once the queue is empty instead
+    for (;;) {
+        if (!capacity.load(std::memory_order_relaxed))
+            return Admission::Queue;
+        int64_t d = depth.fetch_add(n) + n;
+        size_t cap = capacity.load(std::memory_order_relaxed);
+        if (!cap || size_t(d) <= cap || d <= int64_t(n)) {
+            NoteHighWater(size_t(d));
+            return Admission::Queue;
+        }
+        if (frame_thread.load(std::memory_order_relaxed) == std::this_thread::get_id() ||
+            tExecuting == this)
+            return Admission::Queue;
+        depth.fetch_sub(n);
+
+        TransactionOverflow policy = overflow.load(std::memory_order_relaxed);
+        if (policy == TransactionOverflow::FailFast) {
+            rejected.fetch_add(n, std::memory_order_relaxed);
+            Refuse(t, n);
+            return Admission::Rejected;
+        }
+        if (policy == TransactionOverflow::DropOldestMergeable && n == 1 && t->merge_key) {
+            Coalesce(*t, lane, producer, true);
+            return Admission::Coalesced;
+        }
+
+        // waiters do not hold their reservation, so that however many of
+        // them there are, draining the queue lets each of them retry
+        blocked.fetch_add(1, std::memory_order_relaxed);
+        room_waiters.fetch_add(1);
+        {
+            std::unique_lock<std::mutex> lock(room_lock);
+            room.wait(lock, [this, n]() {
+                size_t cap = capacity.load(std::memory_order_relaxed);
+                int64_t d = depth.load();
+                return !cap || d <= 0 || size_t(d) + n <= cap;
+            });
+        }
+        room_waiters.fetch_sub(1);
+    }
+}
+
+// folds t into the overflow slot for its merge key, creating the slot if
+// create is set, and returns whether t was taken
+bool ModeManager::data::Coalesce(Transaction& t, TransactionLane lane, const void* producer, bool create)
+{
+    std::lock_guard<std::mutex> lock(overflow_lock);
+    auto slot = overflow_slots.find(t.merge_key);
+    if (slot == overflow_slots.end()) {
+        if (!create)
+            return false;
+        overflow_slots.emplace(t.merge_key, Slot { lane, std::move(t), ++slot_serial, producer });
+        overflowing.store(static_cast<uint32_t>(overflow_slots.size()));
+    }
+    else {
+        Transaction& s = slot->second.transaction;
+        s.exec = std::move(t.exec);
+        s.retained = std::max(s.retained, t.retained);
+        Chain(s.completion, std::move(t.completion));
+        slot->second.producer = producer;
+    }
+    coalesced.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+// resolves the completions of n refused transactions, which will never run
+void ModeManager::data::Refuse(Transaction* t, size_t n)
+{
+    bool any = false;
+    for (size_t i = 0; i < n; ++i) {
+        ForEachCompletion(t[i].completion.get(), [&any](TransactionCompletionState& c) {
+            c.refused.store(true);
+            c.done.store(true);
+            any = true;
+        });
+    }
+    if (any && signal->waiters.load()) {
+        { std::lock_guard<std::mutex> lock(signal->lock); }
+        signal->resolved.notify_all();
+    }
+}
+
+// accounts for n transactions having left the queue, and wakes producers
+// waiting for room
+void ModeManager::data::Drained(size_t n)
+{
+    if (!n)
+        return;
+    if (capacity.load(std::memory_order_relaxed))
+        depth.fetch_sub(n);
+    dequeued.fetch_add(n, std::memory_order_relaxed);
+    if (room_waiters.load()) {
+        { std::lock_guard<std::mutex> lock(room_lock); }
+        room.notify_all();
+    }
+}
+
+// takes the overflow slots, oldest first, into drained once nothing admitted
+// before them is left to run, and returns how many it took. A slot stays
+// behind the queue until then, unless its producer flushes it sooner.
+size_t ModeManager::data::TakeOverflow()
+{
+    if (!overflowing.load())
+        return 0;
+    std::lock_guard<std::mutex> lock(overflow_lock);
+    if (capacity.load(std::memory_order_relaxed) && depth.load() > 0)
+        return 0;
+    size_t n = overflow_slots.size();
+    if (drained.size() < n)
+        drained.resize(n);
+    std::vector<Slot*> slots;
+    for (auto& s : overflow_slots)
+        slots.push_back(&s.second);
+    std::sort(slots.begin(), slots.end(), [](const Slot* a, const Slot* b) {
+        return a->serial < b->serial;
+    });
+    for (size_t i = 0; i < n; ++i)
+        drained[i] = std::move(slots[i]->transaction);
+    overflow_slots.clear();
+    overflowing.store(0);
+    dequeued.fetch_add(n, std::memory_order_relaxed);
+    return n;
+}
+
+// appends up to limit transactions from lane to the n already drained, and
+// returns the new total
+size_t ModeManager::data::Drain(Lane& lane, size_t n, size_t limit)
+{
+    while (limit) {
+        size_t chunk = std::min(limit, kDrainChunk);
+        if (drained.size() < n + chunk)
+            drained.resize(n + chunk);
+        size_t got = lane.queue.try_dequeue_bulk(lane.consumer, drained.begin() + n, chunk);
+        n += got;
+        limit -= got;
+        if (got < chunk)
+            break;
+    }
+    return n;
+}
+
+// executes count transactions. Without workers they simply run in order.
+// With workers, each transaction is assigned to the earliest wave after every
+// earlier transaction it conflicts with, so a wave never holds two
+// transactions with the same key, and a transaction with no key is a wave of
+// its own. The waves then run one after another, each across the workers.
+void ModeManager::data::Execute(Transaction* batch, size_t count)
+{
+    if (!workers || count < 2) {
+        for (size_t i = 0; i < count; ++i)
+            if (batch[i].exec)
+                batch[i].exec();
+        return;
+    }
+
+    last_wave.clear();
+    wave.resize(count);
+    uint32_t floor = 0;     // no wave before this may be used
+    uint32_t waves = 0;
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t key = batch[i].conflict_key;
+        uint32_t w;
+        if (!key) {
+            w = waves;
+            floor = w + 1;
+        }
+        else {
+            auto last = last_wave.find(key);
+            w = last == last_wave.end() ? floor : std::max(floor, last->second + 1);
+            last_wave[key] = w;
+        }
+        wave[i] = w;
+        waves = std::max(waves, w + 1);
+    }
+
+    // bucket the transactions by wave, keeping enqueue order within a wave
+    wave_start.assign(waves + 1, 0);
+    for (size_t i = 0; i < count; ++i)
+        ++wave_start[wave[i] + 1];
+    for (uint32_t w = 0; w < waves; ++w)
+        wave_start[w + 1] += wave_start[w];
+    order.resize(count);
+    for (size_t i = 0; i < count; ++i)
+        order[wave_start[wave[i]]++] = static_cast<uint32_t>(i);
+    for (uint32_t w = waves; w > 0; --w)
+        wave_start[w] = wave_start[w - 1];
+    wave_start[0] = 0;
+
+    for (uint32_t w = 0; w < waves; ++w) {
+        uint32_t* members = order.data() + wave_start[w];
+        size_t n = wave_start[w + 1] - wave_start[w];
+        auto run = [this, batch, members](size_t i) {
+            Transaction& t = batch[members[i]];
+            if (t.exec) {
+                const void* outer = tExecuting;
+                tExecuting = this;
+                t.exec();
+                tExecuting = outer;
+            }
+        };
+        if (n == 1)
+            run(0);
+        else
+            workers->For(n, run);
+    }
+}
+
+ModeManager::ModeManager()
+    : _self(new data())
+{
+    // until the first frame says otherwise, the constructing thread is
+    // taken to be the frame thread
+    _self->frame_thread.store(std::this_thread::get_id());
+    if (!gCanonical)
+        gCanonical = this;
+}
+
+ModeManager::~ModeManager()
+{
+    if (gCanonical == this)
+        gCanonical = nullptr;
+    delete _self;
+}
+
+ModeManager* ModeManager::Canonical()
+{
+    return gCanonical;
+}
+
+// returns the index for name, or UINT32_MAX if its id belongs to another name
+template <typename T>
+uint32_t ModeManager::data::Registry<T>::Register(const std::string& name, std::function<std::shared_ptr<T>()> fn)
+{
+    uint64_t key = ModeNameId(name);
+    auto id = ids.find(key);
+    if (id != ids.end()) {
+        if (names[id->second] != name)
+            return UINT32_MAX;
+        factories[id->second] = std::move(fn);
+        return id->second;
+    }
+
+    uint32_t index = static_cast<uint32_t>(names.size());
+    names.push_back(name);
+    factories.push_back(std::move(fn));
+    ids[key] = index;
+    return index;
+}
+
+const std::map< std::string, std::shared_ptr<Activity> > ModeManager::Activities() const
+{
+    std::map< std::string, std::shared_ptr<Activity> > activities;
+    for (auto& r : _self->activity_records)
+        if (r.instance)
+            activities[r.name] = r.instance;
+    return activities;
+}
+
+ActivitySpan ModeManager::ActivityRecords() const
+{
+    return ActivitySpan(_self->activity_records.data(), _self->activity_records.size());
+}
+
+uint64_t ModeManager::ActivitiesGeneration() const
+{
+    return _self->activities_generation;
+}
+
+const std::vector<std::string>& ModeManager::ActivityNames() const
+{
+    return _self->activity_registry.names;
+}
+
+const std::vector<std::string>& ModeManager::MajorModeNames() const
+{
+    return _self->major_mode_registry.names;
+}
+
+ActivityHandle ModeManager::_register_activity(const std::string& name, std::function< std::shared_ptr<Activity>() > fn)
+{
+    uint32_t i = _self->activity_registry.Register(name, std::move(fn));
+    if (i == _self->activity_records.size()) {
+        _self->activity_records.push_back({ name, nullptr });
+        ++_self->activities_generation;
+    }
+    return { i };
+}
+
+MajorModeHandle ModeManager::_register_major_mode(const std::string& name, std::function< std::shared_ptr<MajorMode>() > fn)
+{
+    uint32_t i = _self->major_mode_registry.Register(name, std::move(fn));
+    if (i == _self->major_mode_records.size())
+        _self->major_mode_records.push_back({ name, nullptr });
+    return { i };
+}
+
+ActivityHandle ModeManager::FindActivityHandle(uint64_t id) const
+{
+    auto& ids = _self->activity_registry.ids;
+    auto i = ids.find(id);
+    return i == ids.end() ? ActivityHandle() : ActivityHandle { i->second };
+}
+
+MajorModeHandle ModeManager::FindMajorModeHandle(uint64_t id) const
+{
+    auto& ids = _self->major_mode_registry.ids;
+    auto i = ids.find(id);
+    return i == ids.end() ? MajorModeHandle() : MajorModeHandle { i->second };
+}
+
+const std::shared_ptr<MajorMode>& ModeManager::FindMode(MajorModeHandle h)
+{
+    static const std::shared_ptr<MajorMode> none;
+    if (h.index >= _self->major_mode_records.size())
+        return none;
+    auto& records = _self->major_mode_records;
+    if (!records[h.index].instance) {
+        // a factory may register modes of its own, growing both vectors, so
+        // it is called through a copy, and the record found again afterwards
+        auto factory = _self->major_mode_registry.factories[h.index];
+        if (factory) {
+            std::shared_ptr<MajorMode> instance = factory();
+            auto& r = records[h.index];
+            if (!r.instance)
+                r.instance = std::move(instance);
+        }
+    }
+    return records[h.index].instance;
+}
+
+const std::shared_ptr<Activity>& ModeManager::FindActivity(ActivityHandle h)
+{
+    static const std::shared_ptr<Activity> none;
+    if (h.index >= _self->activity_records.size())
+        return none;
+    auto& records = _self->activity_records;
+    if (!records[h.index].instance) {
+        // as for modes, the factory may register activities
+        auto factory = _self->activity_registry.factories[h.index];
+        if (factory) {
+            std::shared_ptr<Activity> instance = factory();
+            auto& r = records[h.index];
+            if (!r.instance && instance) {
+                r.instance = std::move(instance);
+                ++_self->activities_generation;
+            }
+        }
+    }
+    return records[h.index].instance;
+}
+
+std::shared_ptr<Mode> ModeManager::FindMode(std::string_view name)
+{
+    return FindMode(FindMajorModeHandle(ModeNameId(name)));
+}
+
+std::shared_ptr<Activity> ModeManager::FindActivity(std::string_view name)
+{
+    return FindActivity(FindActivityHandle(ModeNameId(name)));
+}
+
+MajorMode* ModeManager::CurrentMajorMode() const
+{
+    return _self->major_mode.get();
+}
+
+namespace {
+
+template <typename C, typename F>
+void InsertCall(std::vector<C>& calls, F fn, void* self, uint32_t index)
+{
+    if (!fn)
+        return;
+    auto at = std::lower_bound(calls.begin(), calls.end(), index,
+                               [](const C& c, uint32_t i) { return c.index < i; });
+    calls.insert(at, { fn, self, index });
+}
+
+template <typename C>
+void EraseCall(std::vector<C>& calls, uint32_t index)
+{
+    auto at = std::lower_bound(calls.begin(), calls.end(), index,
+                               [](const C& c, uint32_t i) { return c.index < i; });
+    if (at != calls.end() && at->index == index)
+        calls.erase(at);
+}
+
+} // anon
+
+void ModeManager::data::Mark(uint32_t index)
+{
+    if (is_dirty.size() <= index)
+        is_dirty.resize(activity_records.size(), 0);
+    if (!is_dirty[index]) {
+        is_dirty[index] = 1;
+        dirty.push_back(index);
+    }
+    ++activities_generation;
+}
+
+// the tables hold the callbacks as they were when the activity was
+// activated; an activity that changes its callbacks must be reactivated
+void ModeManager::data::Insert(uint32_t index)
+{
+    Activity* a = activity_records[index].instance.get();
+    active.insert(std::lower_bound(active.begin(), active.end(), index), index);
+    const LabActivity& la = a->activity;
+    InsertCall(update_calls, la.Update, a, index);
+    InsertCall(menu_calls, la.Menu, a, index);
+    InsertCall(render_calls, la.Render, a, index);
+    InsertCall(ui_calls, la.RunUI, a, index);
+    InsertCall(hover_bids, la.ViewportHoverBid, a, index);
+    InsertCall(drag_bids, la.ViewportDragBid, a, index);
+}
+
+void ModeManager::data::Erase(uint32_t index)
+{
+    active.erase(std::lower_bound(active.begin(), active.end(), index));
+    EraseCall(update_calls, index);
+    EraseCall(menu_calls, index);
+    EraseCall(render_calls, index);
+    EraseCall(ui_calls, index);
+    EraseCall(hover_bids, index);
+    EraseCall(drag_bids, index);
+}
+
+// brings active, and the tables, up to date with the activities marked
+// since the last patch, touching only those
+void ModeManager::data::Patch()
+{
+    for (uint32_t index : dirty) {
+        is_dirty[index] = 0;
+        auto& a = activity_records[index].instance;
+        bool want = a && a->IsActive();
+        bool have = std::binary_search(active.begin(), active.end(), index);
+        if (want && !have)
+            Insert(index);
+        else if (!want && have)
+            Erase(index);
+    }
+    dirty.clear();
+}
+
+void ModeManager::_mark_activity(ActivityHandle h)
+{
+    _self->Mark(h.index);
+}
+
+void ModeManager::_set_activities()
+{
+    if (!_self->dirty.empty())
+        _self->Patch();
+}
+
+void ModeManager::ActivateActivities(const ActivityHandle* handles, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        Activity* a = FindActivity(handles[i]).get();
+        if (a) {
+            a->Activate();
+            _mark_activity(handles[i]);
+        }
+    }
+}
+
+void ModeManager::DeactivateActivities(const ActivityHandle* handles, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        Activity* a = FindActivity(handles[i]).get();
+        if (a) {
+            a->Deactivate();
+            _mark_activity(handles[i]);
+        }
+    }
+}
+
+// the highest bidder, the earliest winning a tie, or null if nobody bids
+std::shared_ptr<Activity> ModeManager::data::Auction(const std::vector<Call<BidCallback>>& bids,
+                                                     const LabViewInteraction& vi) const
+{
+    int best = -1;
+    uint32_t winner = 0;
+    for (auto& b : bids) {
+        int bid = b.fn(b.self, &vi);
+        if (bid > best) {
+            best = bid;
+            winner = b.index;
+        }
+    }
+    return best < 0 ? nullptr : activity_records[winner].instance;
+}
+
+void ModeManager::_deactivate_major_mode(const std::string& name)
+{
+    auto& mm = _self->major_mode;
+    if (mm && mm->Name() == name) {
+        mm->Deactivate();
+        mm.reset();
+    }
+}
+
+void ModeManager::_activate_major_mode(MajorModeHandle h)
+{
+    auto mode = FindMode(h);
+    if (!mode || mode == _self->major_mode)
+        return;
+
+    if (_self->major_mode)
+        _deactivate_major_mode(_self->major_mode->Name());
+
+    mode->Activate();
+    _self->major_mode = mode;
+
+    const std::vector<std::string>& config = mode->ModeConfiguration();
+    if (mode->MustDeactivateUnrelatedModesOnActivation()) {
+        auto& records = _self->activity_records;
+        for (uint32_t i = 0; i < records.size(); ++i) {
+            auto& r = records[i];
+            if (r.instance && r.instance->IsActive() &&
+                std::find(config.begin(), config.end(), r.name) == config.end()) {
+                r.instance->Deactivate();
+                _self->Mark(i);
+            }
+        }
+    }
+    for (auto& name : config) {
+        ActivityHandle ah = FindActivityHandle(ModeNameId(name));
+        Activity* a = FindActivity(ah).get();
+        if (a && !a->IsActive()) {
+            a->Activate();
+            _mark_activity(ah);
+        }
+    }
+    _set_activities();
+}
+
+void ModeManager::RunModeUIs(const LabViewInteraction& vi)
+{
+    _set_activities();
+    for (auto& c : _self->ui_calls)
+        c.fn(c.self, &vi);
+}
+
+void ModeManager::RunModeRendering(const LabViewInteraction& vi)
+{
+    _set_activities();
+    for (auto& c : _self->render_calls)
+        c.fn(c.self, &vi);
+}
+
+void ModeManager::RunMainMenu()
+{
+    _set_activities();
+    for (auto& c : _self->menu_calls)
+        c.fn(c.self);
+}
+
+void ModeManager::RunViewportHovering(const LabViewInteraction& vi)
+{
+    _set_activities();
+    auto owner = _self->Auction(_self->hover_bids, vi);
+    _self->hover_owner = owner;
+    if (owner && owner->activity.ViewportHovering)
+        owner->activity.ViewportHovering(owner.get(), &vi);
+}
+
+void ModeManager::RunViewportDragging(const LabViewInteraction& vi)
+{
+    _set_activities();
+    if (vi.start || !_self->drag_owner)
+        _self->drag_owner = _self->Auction(_self->drag_bids, vi);
+
+    auto& owner = _self->drag_owner;
+    if (owner && owner->activity.ViewportDragging)
+        owner->activity.ViewportDragging(owner.get(), &vi);
+
+    if (vi.end)
+        owner.reset();
+}
+
+bool ModeManager::EnqueueTransaction(Transaction&& t, TransactionLane lane)
+{
+    if (TransactionTap* tap = _self->tap.load(std::memory_order_acquire))
+        tap->Enqueued(&t, 1, lane, TransactionSource::Implicit);
+    if (!tGroups.empty()) {
+        if (TransactionGroup* g = OpenGroup(this)) {
+            g->batch.push_back(std::move(t));
+            return true;
+        }
+    }
+    switch (_self->Admit(&t, 1, lane, &tImplicitProducer)) {
+        case data::Admission::Queue:     _self->Enqueue(lane, std::move(t)); return true;
+        case data::Admission::Coalesced: return true;
+        case data::Admission::Rejected:  return false;
+    }
+    return false;
+}
+
+struct TransactionProducer::data
+{
+    ModeManager* manager;
+    TransactionLane lane;
+    TransactionQueue& queue;
+    TransactionQueue::producer_token_t token;
+
+    data(ModeManager* mm, TransactionLane lane)
+        : manager(mm), lane(lane), queue(mm->_self->Queue(lane)), token(queue) {}
+
+    // moves the producer's overflow slots ahead of what it enqueues next
+    void Flush() {
+        manager->_self->FlushSlots(lane, this, [this](Transaction&& s) {
+            queue.enqueue(token, std::move(s));
+        });
+    }
+};
+
+TransactionProducer::TransactionProducer() = default;
+TransactionProducer::TransactionProducer(data* self) : _self(self) {}
+TransactionProducer::TransactionProducer(TransactionProducer&&) noexcept = default;
+TransactionProducer& TransactionProducer::operator=(TransactionProducer&&) noexcept = default;
+TransactionProducer::~TransactionProducer() = default;
+
+bool TransactionProducer::Enqueue(Transaction&& t)
+{
+    if (TransactionTap* tap = _self->manager->_self->tap.load(std::memory_order_acquire))
+        tap->Enqueued(&t, 1, _self->lane, TransactionSource::Producer);
+    if (!tGroups.empty()) {
+        if (TransactionGroup* g = OpenGroup(_self->manager)) {
+            g->batch.push_back(std::move(t));
+            return true;
+        }
+    }
+    switch (_self->manager->_self->Admit(&t, 1, _self->lane, _self.get())) {
+        case ModeManager::data::Admission::Queue:
+            _self->Flush();
+            _self->queue.enqueue(_self->token, std::move(t));
+            return true;
+        case ModeManager::data::Admission::Coalesced:
+            return true;
+        case ModeManager::data::Admission::Rejected:
+            return false;
+    }
+    return false;
+}
+
+bool TransactionProducer::Enqueue(Transaction* batch, size_t count)
+{
+    ModeManager::data& mm = *_self->manager->_self;
+    if (TransactionTap* tap = mm.tap.load(std::memory_order_acquire))
+        tap->Enqueued(batch, count, _self->lane, TransactionSource::ProducerBatch);
+    if (!tGroups.empty()) {
+        if (TransactionGroup* g = OpenGroup(_self->manager)) {
+            for (size_t i = 0; i < count; ++i)
+                g->batch.push_back(std::move(batch[i]));
+            return true;
+        }
+    }
+
+    // while any key has an overflow slot, the batch's members may need to
+    // follow one, so they are admitted one at a time; not through Enqueue,
+    // which would show them to the tap again
+    if (mm.overflowing.load()) {
+        bool all = true;
+        for (size_t i = 0; i < count; ++i) {
+            switch (mm.Admit(&batch[i], 1, _self->lane, _self.get())) {
+                case ModeManager::data::Admission::Queue:
+                    _self->Flush();
+                    _self->queue.enqueue(_self->token, std::move(batch[i]));
+                    break;
+                case ModeManager::data::Admission::Coalesced:
+                    break;
+                case ModeManager::data::Admission::Rejected:
+                    all = false;
+                    break;
+            }
+        }
+        return all;
+    }
+    if (mm.Admit(batch, count, _self->lane, _self.get()) == ModeManager::data::Admission::Rejected)
+        return false;
+    _self->Flush();
+    _self->queue.enqueue_bulk(_self->token, std::make_move_iterator(batch), count);
+    return true;
+}
+
+TransactionProducer ModeManager::MakeTransactionProducer(TransactionLane lane)
+{
+    return TransactionProducer(new TransactionProducer::data(this, lane));
+}
+
+TransactionCompletion ModeManager::TrackTransaction(Transaction& t)
+{
+    auto state = std::make_shared<TransactionCompletionState>();
+    state->signal = _self->signal;
+    Chain(state, std::move(t.completion));
+    t.completion = state;
+    TransactionCompletion c;
+    c._state = std::move(state);
+    return c;
+}
+
+void ModeManager::SetBackgroundQuota(size_t per_frame)
+{
+    _self->background_quota = per_frame;
+}
+
+void ModeManager::SetTransactionBudget(double seconds)
+{
+    _self->budget_ns = static_cast<int64_t>(seconds * 1e9);
+}
+
+TransactionBacklog ModeManager::Backlog() const
+{
+    return _self->backlog;
+}
+
+void ModeManager::SetTransactionTap(TransactionTap* tap)
+{
+    _self->tap.store(tap, std::memory_order_release);
+}
+
+void ModeManager::SetTransactionCapacity(size_t capacity, TransactionOverflow policy)
+{
+    // depth was not kept while the queue was unbounded, so it starts again
+    // from what is queued; enqueues racing with this may be miscounted
+    _self->overflow.store(policy);
+    if (capacity && !_self->capacity.load())
+        _self->depth.store(static_cast<int64_t>(_self->Queued()));
+    _self->capacity.store(capacity);
+
+    // producers blocked under the old capacity may fit under the new one
+    { std::lock_guard<std::mutex> lock(_self->room_lock); }
+    _self->room.notify_all();
+}
+
+TransactionQueueStats ModeManager::QueueStats() const
+{
+    TransactionQueueStats s;
+    int64_t depth = _self->capacity.load(std::memory_order_relaxed)
+                  ? _self->depth.load(std::memory_order_relaxed)
+                  : static_cast<int64_t>(_self->Queued());
+    uint64_t dequeued = _self->dequeued.load(std::memory_order_relaxed);
+    s.depth = depth > 0 ? size_t(depth) : 0;
+    s.high_water = _self->high_water.load(std::memory_order_relaxed);
+    s.enqueued = dequeued + s.depth;
+    s.rejected = _self->rejected.load(std::memory_order_relaxed);
+    s.coalesced = _self->coalesced.load(std::memory_order_relaxed);
+    s.blocked = _self->blocked.load(std::memory_order_relaxed);
+    return s;
+}
+
+void ModeManager::BeginTransactionGroup(TransactionMessage message, size_t reserve,
+                                        TransactionLane lane)
+{
+    if (TransactionTap* tap = _self->tap.load(std::memory_order_acquire))
+        tap->GroupBegan(message, lane);
+    if (TransactionGroup* g = OpenGroup(this)) {
+        ++g->depth;
+        return;
+    }
+    tGroups.push_back({ this, 1, lane, std::move(message), {} });
+    tGroups.back().batch.reserve(reserve);
+}
+
+bool ModeManager::EndTransactionGroup()
+{
+    if (TransactionTap* tap = _self->tap.load(std::memory_order_acquire))
+        tap->GroupEnded();
+    TransactionGroup* g = OpenGroup(this);
+    if (!g || --g->depth)
+        return true;
+
+    TransactionLane lane = g->lane;
+    TransactionMessage message = std::move(g->message);
+    auto batch = std::make_shared<std::vector<Transaction>>(std::move(g->batch));
+    tGroups.erase(tGroups.begin() + (g - tGroups.data()));
+    if (batch->empty())
+        return true;
+
+    // the members' completions are gathered, to resolve with the group
+    std::shared_ptr<TransactionCompletionState> completion;
+    size_t retained = batch->capacity() * sizeof(Transaction);
+    for (auto& t : *batch) {
+        retained += t.retained + t.message.HeapBytes() + t.exec.HeapBytes() + t.undo.HeapBytes();
+        Chain(completion, std::move(t.completion));
+    }
+
+    Transaction group(std::move(message),
+        [batch]() {
+            for (auto& t : *batch)
+                if (t.exec)
+                    t.exec();
+        },
+        [batch]() {
+            for (auto t = batch->rbegin(); t != batch->rend(); ++t)
+                if (t->undo)
+                    t->undo();
+        });
+    group.retained = retained;
+    group.completion = std::move(completion);
+    switch (_self->Admit(&group, 1, lane, &tImplicitProducer)) {
+        case data::Admission::Queue:     _self->Enqueue(lane, std::move(group)); return true;
+        case data::Admission::Coalesced: return true;
+        case data::Admission::Rejected:  return false;
+    }
+    return false;
+}
+
+void ModeManager::SetTransactionWorkers(unsigned count)
+{
+    _self->workers.reset(count ? new WorkerPool(count) : nullptr);
+}
+
+void ModeManager::UpdateTransactionQueueActivationAndModes()
+{
+    // the interactive lane is served first, and the background lane up to its
+    // quota behind it, a slice at a time until the queue or the budget runs
+    // out; once the queue is empty, the overflow slots run behind it. The
+    // frame's transactions are journaled as one batch, so the journal's
+    // listeners hear about them once.
+    data& d = *_self;
+    d.frame_thread.store(std::this_thread::get_id(), std::memory_order_relaxed);
+    if (!d.capacity.load(std::memory_order_relaxed))
+        d.NoteHighWater(d.Queued());
+    auto& interactive = d.lanes[size_t(TransactionLane::Interactive)];
+    auto& background = d.lanes[size_t(TransactionLane::Background)];
+    size_t background_left = d.background_quota;
+    size_t ran = 0;
+    int64_t start = MonotonicNanoseconds();
+    int64_t elapsed = 0;
+
+    _journal.BeginBatch();
+    for (;;) {
+        size_t slice = data::kDrainChunk;
+        if (d.budget_ns) {
+            int64_t left = d.budget_ns - elapsed;
+            if (ran && left <= 0)
+                break;
+            if (d.ns_per_transaction > 0) {
+                double fits = std::max<double>(left, 0) / d.ns_per_transaction;
+                slice = static_cast<size_t>(std::min<double>(std::max(fits, 1.0), slice));
+            }
+            else
+                slice = data::kProbeSlice;  // nothing measured yet
+        }
+
+        size_t count = d.Drain(interactive, 0, slice);
+        if (count < slice) {
+            size_t n = d.Drain(background, count, std::min(slice - count, background_left));
+            background_left -= n - count;
+            count = n;
+        }
+        if (count)
+            d.Drained(count);
+        else if (!(count = d.TakeOverflow()))
+            break;
+
+        // checkpoints snapshot the state as each node is appended, so while
+        // the journal takes them, each transaction is journaled before the
+        // next runs, and the workers sit out
+        Transaction* batch = d.drained.data();
+        bool serial = !d.workers || _journal.CheckpointInterval();
+        if (!serial)
+            d.Execute(batch, count);
+        for (size_t i = 0; i < count; ++i) {
+            if (serial && batch[i].exec)
+                batch[i].exec();
+            if (batch[i].completion)
+                d.completed.push_back(std::move(batch[i].completion));
+            _journal.Append(std::move(batch[i]));
+        }
+
+        int64_t now = MonotonicNanoseconds() - start;
+        double per = double(now - elapsed) / count;
+        d.ns_per_transaction = d.ns_per_transaction > 0 ? 0.75 * d.ns_per_transaction + 0.25 * per : per;
+        elapsed = now;
+        ran += count;
+    }
+    _journal.EndBatch();
+
+    // waiters check done under the signal's lock, so taking the lock after
+    // resolving, before notifying, ensures none of them misses the wakeup
+    if (!d.completed.empty()) {
+        for (auto& c : d.completed)
+            ForEachCompletion(c.get(), [](TransactionCompletionState& s) { s.done.store(true); });
+        d.completed.clear();
+        if (d.signal->waiters.load()) {
+            { std::lock_guard<std::mutex> lock(d.signal->lock); }
+            d.signal->resolved.notify_all();
+        }
+    }
+
+    TransactionBacklog& b = d.backlog;
+    b.interactive = interactive.queue.size_approx();
+    b.background = background.queue.size_approx();
+    b.ran = ran;
+    b.elapsed = elapsed * 1e-9;
+    b.seconds = (b.interactive + b.background) * d.ns_per_transaction * 1e-9;
+    b.frames = 0;
+    if (b.interactive || b.background) {
+        b.frames = d.budget_ns ? b.seconds / (d.budget_ns * 1e-9) : 1;
+        if (d.background_quota)
+            b.frames = std::max(b.frames, double(b.background) / d.background_quota);
+    }
+
+    if (_major_mode_pending) {
+        _activate_major_mode(_major_mode_pending);
+        _major_mode_pending = MajorModeHandle();
+    }
+
+    _set_activities();
+    for (auto& c : _self->update_calls)
+        c.fn(c.self);
+}
+
+} // lab
@@ -10,6 +10,8 @@
  Modes has no dependencies, except the the cpp file requires
  moodycamel's concurrentqueue.hpp obtained from
  https://github.com/cameron314/concurrentqueue
+ unless LAB_TRANSACTION_QUEUE_MPSC is defined, in which case the bundled
+ TransactionRing.h is used instead.
 
  Currently, there is a USD dependency, which can be elided by defining
  HAVE_NO_USD. When I rethink the Transaction object in the future, the
@@ -21,11 +23,20 @@
 #define Modes_h
 
 #include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
+#include <atomic>
 #include <functional>
+#include <initializer_list>
 #include <map>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "InlineFunction.h"
 
 #ifndef HAVE_NO_USD
 #include <pxr/usd/usd/prim.h>
@@ -87,79 +98,447 @@ typedef struct LabActivity {
 namespace lab {
 class ModeManager;
 
+// Transactions store exec and undo inline when the closure fits in this many
+// bytes, which avoids a heap allocation per closure. Larger closures still
+// work, but are allocated.
+#ifndef LAB_TRANSACTION_INLINE_BYTES
+#define LAB_TRANSACTION_INLINE_BYTES 48
+#endif
+
+using TransactionFn = InlineFunction<void(), LAB_TRANSACTION_INLINE_BYTES>;
+
+// A TransactionMessage labels a transaction in the history UI. A label with
+// static storage, such as a string literal, can be wrapped in Literal(), and
+// is then referenced rather than copied. Any other string, character arrays
+// included, since an array may as well be a reused buffer, is copied, and
+// freed along with the transaction. Interned() stores a label once for the
+// life of the process, which suits labels drawn from a small fixed set, but
+// not labels built per edit, which would accumulate forever; each thread
+// remembers the labels it has interned, so interning one again takes no
+// lock. A formatter defers building the text until the UI asks for it with
+// Str().
+class TransactionMessage {
+public:
+    using Formatter = InlineFunction<std::string(), 48>;
+
+    TransactionMessage() = default;
+
+    // arrays decay, and are copied like any other pointer
+    template <typename T, typename = typename std::enable_if<
+                              std::is_same<T, const char*>::value ||
+                              std::is_same<T, char*>::value>::type>
+    TransactionMessage(T s) : _kind(Kind::Owned), _owned(new std::string(s)) {}
+    TransactionMessage(const std::string& s) : _kind(Kind::Owned), _owned(new std::string(s)) {}
+    TransactionMessage(std::string&& s) : _kind(Kind::Owned), _owned(new std::string(std::move(s))) {}
+    TransactionMessage(std::string_view s) : _kind(Kind::Owned), _owned(new std::string(s)) {}
+
+    // s must outlive every transaction labelled with it
+    static TransactionMessage Literal(const char* s) {
+        TransactionMessage m;
+        m._kind = Kind::Literal;
+        m._literal = s;
+        return m;
+    }
+
+    static TransactionMessage Interned(std::string_view s) {
+        TransactionMessage m;
+        m._kind = Kind::Interned;
+        m._id = _intern(s);
+        return m;
+    }
+
+    static TransactionMessage Deferred(Formatter format) {
+        TransactionMessage m;
+        m._kind = Kind::Deferred;
+        m._format = new Formatter(std::move(format));
+        return m;
+    }
+
+    TransactionMessage(TransactionMessage&& m) noexcept : _kind(m._kind), _literal(m._literal) {
+        m._kind = Kind::Empty;
+    }
+    TransactionMessage& operator=(TransactionMessage&& m) noexcept {
+        if (this != &m) {
+            _release();
+            _kind = m._kind;
+            _literal = m._literal;
+            m._kind = Kind::Empty;
+        }
+        return *this;
+    }
+    TransactionMessage(const TransactionMessage&) = delete;
+    TransactionMessage& operator=(const TransactionMessage&) = delete;
+    ~TransactionMessage() { _release(); }
+
+    // renders the message; deferred messages are formatted on each call
+    std::string Str() const;
+
+    bool Empty() const { return _kind == Kind::Empty; }
+
+    // the number of distinct labels interned so far, which only grows
+    static size_t InternedCount();
+
+    // bytes owned by this message alone; interned text is shared
+    size_t HeapBytes() const {
+        switch (_kind) {
+            case Kind::Owned:    return sizeof(std::string) + _owned->capacity();
+            case Kind::Deferred: return sizeof(Formatter) + _format->HeapBytes();
+            default:             return 0;
+        }
+    }
+
+private:
+    enum class Kind : uint8_t { Empty, Literal, Interned, Owned, Deferred };
+
+    Kind _kind = Kind::Empty;
+    union {
+        const char* _literal = nullptr;
+        uint32_t _id;
+        std::string* _owned;
+        Formatter* _format;
+    };
+
+    static uint32_t _intern(std::string_view s);
+    static const std::string& _interned(uint32_t id);
+
+    void _release() {
+        if (_kind == Kind::Owned)
+            delete _owned;
+        else if (_kind == Kind::Deferred)
+            delete _format;
+        _kind = Kind::Empty;
+    }
+};
+
+// the shared state behind a TransactionCompletion
+struct TransactionCompletionState;
+
+// Transactions are move only. An empty undo, the default, does nothing.
 struct Transaction {
-    std::string message;
-    std::function<void()> exec;
-    std::function<void()> undo;
+    TransactionMessage message;
+    TransactionFn exec;
+    TransactionFn undo;
+
+    // bytes kept alive by exec and undo beyond the closures themselves, for
+    // example a captured buffer of previous values. The journal cannot see
+    // inside the closures, so producers that pin large data report it here
+    // so that it counts against the journal's budget.
+    size_t retained = 0;
+
+    // transactions that share a non-zero merge key, and arrive within the
+    // journal's merge window or continue a merge, are folded into a single
+    // journal node that keeps the first undo and the last exec. Continuous
+    // edits such as a manipulator drag set a key so that the whole gesture
+    // becomes one undo step.
+    uint64_t merge_key = 0;
+
+    // set on every transaction of a gesture but the first, so that it merges
+    // with the current node if their merge keys match, whatever the merge
+    // window. A drag would set it on all but its start interaction. The mark
+    // travels with the transaction, so the gesture stays one step however
+    // many frames the queue takes to deliver its last transactions.
+    bool merge_continues = false;
+
+    // transactions with different non-zero conflict keys touch disjoint
+    // state, and may be executed concurrently when the ModeManager has
+    // transaction workers. Transactions sharing a key run in enqueue order,
+    // and a key of zero, the default, runs alone after everything enqueued
+    // before it and before everything enqueued after it.
+    uint64_t conflict_key = 0;
+
+    // set by ModeManager::TrackTransaction, and resolved once the
+    // transaction has run and been journaled
+    std::shared_ptr<TransactionCompletionState> completion;
 
 #ifndef HAVE_NO_USD
     pxr::UsdPrim prim;
     pxr::TfToken token;
+
+    // a conflict key for edits confined to a single prim
+    static uint64_t ConflictKey(const pxr::UsdPrim& prim) {
+        uint64_t h = prim.GetPath().GetHash();
+        return h ? h : 1;
+    }
+
+    // a merge key identifying edits to the same property of the same prim
+    static uint64_t MergeKey(const pxr::UsdPrim& prim, const pxr::TfToken& token) {
+        uint64_t h = prim.GetPath().GetHash();
+        h ^= token.Hash() + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+        return h ? h : 1;
+    }
 #endif
 
     Transaction() = default;
-    Transaction(std::string m, std::function<void()> e, std::function<void()> u)
-        : message(m), exec(e), undo(u) {}
-    Transaction(std::string m, std::function<void()> e)
-        : message(m), exec(e), undo([](){}) {}
+    Transaction(TransactionMessage m, TransactionFn e, TransactionFn u)
+        : message(std::move(m)), exec(std::move(e)), undo(std::move(u)) {}
+    Transaction(TransactionMessage m, TransactionFn e)
+        : message(std::move(m)), exec(std::move(e)) {}
 
 #ifndef HAVE_NO_USD
-    Transaction(std::string m, pxr::UsdPrim prim, pxr::TfToken token, std::function<void()> e)
-        : message(m), prim(prim), token(token), exec(e), undo([](){}) {}
+    Transaction(TransactionMessage m, pxr::UsdPrim prim, pxr::TfToken token, TransactionFn e)
+        : message(std::move(m)), exec(std::move(e)), prim(prim), token(token) {}
 #endif
 
     Transaction(Transaction&&) = default;
     Transaction& operator=(Transaction&& t) = default;
-    Transaction(const Transaction& t) {
-        message = t.message;
-        exec = t.exec;
-        undo = t.undo;
-#ifndef HAVE_NO_USD
-        prim = t.prim;
-        token = t.token;
-#endif
-    }
+    Transaction(const Transaction&) = delete;
     Transaction& operator=(const Transaction&) = delete;
 };
 
+// Transactions hold closures, which cannot be written out. Applications that
+// persist transactions supply a writer that encodes whatever the closures
+// were built from, and a reader that rebuilds a transaction from those bytes.
+using TransactionWriter = std::function<bool(const Transaction&, std::string& bytes)>;
+using TransactionReader = std::function<bool(const char* bytes, size_t size, Transaction&)>;
+
+// Journal nodes live in an arena owned by the Journal, and refer to each
+// other by 32 bit indices into that arena rather than by pointer.
+typedef uint32_t JournalIndex;
+static constexpr JournalIndex kJournalNil = 0xffffffff;
+
+// Journal statistics are maintained incrementally as the journal changes, so
+// reading them costs nothing, and they may be read from any thread. Define
+// LAB_JOURNAL_STATS to 0 to compile the bookkeeping out; Stats() then
+// reports zeroes.
+#ifndef LAB_JOURNAL_STATS
+#define LAB_JOURNAL_STATS 1
+#endif
+
 struct JournalNode {
     Transaction transaction;
-    JournalNode* next;
-    JournalNode* sibling;   // for forking history
-    JournalNode* parent;    // for undoing history
-
-    // for debugging, the total extant node count is
-    // tracked. The application can call validate() to
-    // ensure that the number of nodes equals the count.
-    // if it differs, there's a bug in the journal.
-    static int count;
-
-    // recursively delete all the nodes after this one
-    // making this node the end of the journal
-    static void Truncate(JournalNode* node);
-    
-    JournalNode() : next(nullptr), sibling(nullptr) {
-        ++count;
+    JournalIndex next = kJournalNil;
+    JournalIndex sibling = kJournalNil;   // for forking history
+    JournalIndex parent = kJournalNil;    // for undoing history
+    uint32_t visited = 0;   // journal clock when this node was last current
+    uint32_t depth = 0;     // steps from the original root
+    uint32_t branch = 0;    // the branch this node belongs to
+#if LAB_JOURNAL_STATS
+    uint32_t children = 0;
+#endif
+};
+
+struct JournalStats {
+    uint32_t nodes = 0;         // live nodes, including the root
+    size_t bytes = 0;           // as reported by Journal::RetainedBytes()
+    uint32_t depth = 0;         // steps from the root to the current node
+    uint32_t branches = 0;      // live branches in the branch table
+    uint32_t leaves = 0;        // tips of history, ie. nodes with no children
+    uint32_t max_fanout = 0;    // most children of any one node
+};
+
+// A branch is a line of history. The root starts branch zero, every append
+// extends the current node's branch, and every fork starts a new branch whose
+// head is the forked node. The tip is the latest node on the branch.
+typedef uint32_t JournalBranchId;
+
+struct JournalBranch {
+    JournalIndex fork_point = kJournalNil;  // the head's parent
+    JournalIndex head = kJournalNil;        // nil if the slot is unused
+    JournalIndex tip = kJournalNil;
+};
+
+// JournalArena hands out nodes from fixed size chunks, so an append costs
+// no allocation beyond the occasional fresh chunk, and a node's address
+// is stable for as long as the node is alive. Released nodes are threaded
+// onto a free list through their next link, and a whole list of nodes can
+// be returned to the arena in one splice.
+class JournalArena {
+    static constexpr uint32_t kChunkBits = 10;
+    static constexpr uint32_t kChunkSize = 1u << kChunkBits;
+
+    std::vector<std::unique_ptr<JournalNode[]>> _chunks;
+    JournalIndex _free = kJournalNil;
+    uint32_t _used = 0;     // high water mark of handed out indices
+    uint32_t _live = 0;
+
+public:
+    JournalArena() = default;
+    JournalArena(const JournalArena&) = delete;
+    JournalArena& operator=(const JournalArena&) = delete;
+
+    JournalNode& operator[](JournalIndex i) {
+        return _chunks[i >> kChunkBits][i & (kChunkSize - 1)];
     }
-    ~JournalNode() {
-        Truncate(this);
-        --count;
+    const JournalNode& operator[](JournalIndex i) const {
+        return _chunks[i >> kChunkBits][i & (kChunkSize - 1)];
     }
+
+    // returns a node with empty links and a default transaction
+    JournalIndex Allocate();
+
+    // returns a list of n nodes, linked head to tail through next, to the
+    // free list. The nodes' transactions must already have been released.
+    void Release(JournalIndex head, JournalIndex tail, uint32_t n);
+
+    uint32_t Live() const { return _live; }
+};
+
+class Journal;
+
+// describes a change to the journal's position. When changes are batched,
+// the counts are summed over the batch, and from is the node that was current
+// before the first change, which may since have been released.
+struct JournalChange {
+    JournalIndex from = kJournalNil;
+    JournalIndex to = kJournalNil;
+    uint32_t undone = 0;        // transactions undone
+    uint32_t redone = 0;        // transactions executed to move forward
+    uint32_t appended = 0;      // transactions appended or forked
+    uint32_t merged = 0;        // transactions merged into an existing node
+};
+
+// A JournalSink is told about each transaction as it enters a journal, and
+// as it leaves. The calls are made on the thread that modifies the journal,
+// and should hand the work off rather than block it.
+class JournalSink {
+public:
+    virtual ~JournalSink() = default;
+
+    // node was appended after its parent, truncating the parent's children
+    virtual void Appended(const Journal&, JournalIndex node) = 0;
+
+    // node was forked from the node that was current, from
+    virtual void Forked(const Journal&, JournalIndex node, JournalIndex from) = 0;
+
+    // t is about to be merged into node
+    virtual void Merged(const Journal&, JournalIndex node, const Transaction& t) = 0;
+
+    // node, and everything after it, is about to be released, because it was
+    // removed or truncated, or evicted to bring the journal within budget
+    virtual void Removed(const Journal&, JournalIndex node) = 0;
+
+    // node, the root's only child, is about to be evicted; the root takes
+    // its place, and stands for the state after it
+    virtual void Evicted(const Journal&, JournalIndex node) = 0;
 };
 
 class Journal {
-    JournalNode* _curr;
+    JournalArena _nodes;
+    JournalIndex _root;
+    JournalIndex _curr;
 
-    static void CountHelper(JournalNode* node, int& total);
+    uint32_t _clock = 0;
+    size_t _bytes = 0;
+    size_t _budget_bytes = 0;
+    uint32_t _budget_nodes = 0;
+
+    int64_t _merge_window_ns = 0;
+    int64_t _merge_last_ns = 0;
+
+public:
+    // a checkpoint is an opaque snapshot of application state, taken just
+    // after a node's transaction has been executed
+    using Snapshot = std::shared_ptr<void>;
+    using SnapshotFn = std::function<Snapshot()>;
+    using RestoreFn = std::function<void(const Snapshot&)>;
+
+private:
+    uint32_t _checkpoint_interval = 0;
+    SnapshotFn _snapshot;
+    RestoreFn _restore;
+    std::unordered_map<JournalIndex, Snapshot> _checkpoints;
+    std::vector<JournalIndex> _path;
+
+    JournalSink* _sink = nullptr;
+
+public:
+    using ChangeListener = std::function<void(const JournalChange&)>;
+
+private:
+    std::vector<std::pair<uint32_t, ChangeListener>> _listeners;
+    uint32_t _next_listener = 1;
+    uint32_t _batch_depth = 0;
+    bool _change_pending = false;
+    JournalChange _change;
+    JournalIndex _redo_tip = kJournalNil;
+
+    // the branch table. _forks maps each fork point to the branches forked
+    // from it, in the order they were forked, which is also the order of
+    // their heads in the fork point's list of children.
+    std::vector<JournalBranch> _branches;
+    std::vector<JournalBranchId> _free_branches;
+    std::unordered_map<JournalIndex, std::vector<JournalBranchId>> _forks;
+
+    struct EvictionCandidate {
+        JournalIndex head;
+        uint32_t visited;
+    };
+    std::vector<EvictionCandidate> _candidates;
+
+#if LAB_JOURNAL_STATS
+    std::vector<uint32_t> _fanout;      // number of nodes with each child count
+    uint32_t _max_fanout = 0;
+    std::atomic<uint32_t> _stat_nodes { 0 };
+    std::atomic<size_t> _stat_bytes { 0 };
+    std::atomic<uint32_t> _stat_depth { 0 };
+    std::atomic<uint32_t> _stat_branches { 0 };
+    std::atomic<uint32_t> _stat_leaves { 0 };
+    std::atomic<uint32_t> _stat_max_fanout { 0 };
+
+    void _stat_node(JournalIndex node, bool added);
+    void _stat_children(JournalIndex node, uint32_t children);
+    void _stat_adopt(JournalIndex node, int delta) {
+        _stat_children(node, _nodes[node].children + delta);
+    }
+    void _publish();
+#else
+    void _stat_node(JournalIndex, bool) {}
+    void _stat_children(JournalIndex, uint32_t) {}
+    void _stat_adopt(JournalIndex, int) {}
+    void _publish() {}
+#endif
+
+    template <typename F>
+    void _walk(JournalIndex head, F&& visit) const;
+
+    void _notify(JournalIndex from, uint32_t undone, uint32_t redone,
+                 uint32_t appended, uint32_t merged);
+    void _flush_change();
+    bool _is_ancestor(JournalIndex ancestor, JournalIndex node) const;
+    JournalIndex _redo_child(JournalIndex node) const;
+
+    JournalBranchId _branch_new(JournalIndex fork_point, JournalIndex head);
+    void _branch_release(JournalIndex node);
+    void _branch_cut(JournalIndex node);
+    uint32_t _collect(JournalIndex first, JournalIndex& head, JournalIndex& tail);
+    void _release_subtree(JournalIndex node);
+    void _unlink(JournalIndex node);
+    void _set_current(JournalIndex node);
+    uint32_t _recency(JournalIndex head) const;
+    bool _over_budget(size_t bytes, uint32_t nodes) const;
+    bool _merge(Transaction& t);
+    void _fold(Transaction& t);
+    void _checkpoint(JournalIndex node);
+    void _truncate(JournalIndex node);
+    void _evict_oldest();
+    JournalIndex _common_ancestor(JournalIndex a, JournalIndex b) const;
 
 public:
     Journal();
+
+    // walks the whole journal, checking that every live node is reachable
+    // from the root, and that the statistics agree. This is a debugging aid;
+    // use Stats() to keep an eye on a journal in production.
     bool Validate();
+
+    // the journal's statistics, safe to call from any thread
+    JournalStats Stats() const;
     
     // append a transaction to the journal. If the journal is not at the end,
-    // the journal is truncated and the new transaction is appended
+    // the journal is truncated and the new transaction is appended. If the
+    // transaction merges with the current node, the current node's exec is
+    // replaced instead, and no node is added.
     void Append(Transaction&& t);
 
+    // transactions with a matching merge key that are appended within this
+    // many seconds of the previous one are merged. Zero, the default,
+    // disables merging by time, leaving only transactions marked
+    // merge_continues.
+    void SetMergeWindow(double seconds);
+
+    // merges t into the current node whatever its merge key
+    void Merge(Transaction&& t);
+
     // fork the journal, creating a new branch. The current node becomes the
     // sibling of the new branch, and the new branch becomes the current node.
     // If there is already a sibling, the new node becomes a sibling of the
@@ -167,10 +546,110 @@ public:
     // the same node.
     void Fork(Transaction&& t);
     
-    // removes mode from the journal but does not delete it
-    void Remove(JournalNode* node);
-    
-    JournalNode root;
+    // removes node, and everything after it, from the journal, and returns
+    // the storage to the arena. If the current node was removed, the removed
+    // node's parent becomes current.
+    void Remove(JournalIndex node);
+
+    // delete all the nodes after this one, making this node the end of the
+    // journal. The whole subtree is returned to the arena in one go, and the
+    // walk is iterative, so arbitrarily deep histories truncate in constant
+    // stack space.
+    void Truncate(JournalIndex node);
+
+    // takes a snapshot of application state at every node whose depth is a
+    // multiple of interval, and at the root if it is current. JumpTo can then
+    // restore the nearest snapshot and replay at most interval transactions,
+    // rather than undoing and redoing every node in between. Smaller
+    // intervals jump faster and retain more snapshots. An interval of zero
+    // disables checkpoints and drops the snapshots already taken.
+    void SetCheckpoints(uint32_t interval, SnapshotFn snapshot, RestoreFn restore);
+    uint32_t CheckpointInterval() const { return _checkpoint_interval; }
+
+    // makes node current, running undo from the current node back to the
+    // common ancestor, and exec from there forward to node, or, if it is
+    // cheaper, restoring the checkpoint nearest to node and replaying the
+    // transactions after it. Listeners hear about the jump once, however far
+    // it goes.
+    void JumpTo(JournalIndex node);
+
+    // steps back toward the root, or forward again, by up to steps nodes in
+    // a single jump, and returns the number of steps taken. Redo retraces
+    // the nodes most recently undone; failing that, it follows the current
+    // node's branch.
+    uint32_t Undo(uint32_t steps = 1);
+    uint32_t Redo(uint32_t steps = 1);
+
+    // listeners are told when the current node changes, or a transaction is
+    // appended, forked, or merged. Between BeginBatch and EndBatch, which
+    // nest, changes are coalesced into a single notification raised by the
+    // outermost EndBatch, so that downstream consumers refresh once.
+    uint32_t AddChangeListener(ChangeListener listener);
+    void RemoveChangeListener(uint32_t id);
+    void BeginBatch() { ++_batch_depth; }
+    void EndBatch();
+
+    // the branches forked from fork_point, in the order they were forked
+    const std::vector<JournalBranchId>& Branches(JournalIndex fork_point) const;
+
+    const JournalBranch& Branch(JournalBranchId id) const { return _branches[id]; }
+    JournalBranchId BranchOf(JournalIndex node) const { return _nodes[node].branch; }
+
+    // visits every live branch, in no particular order, without walking the
+    // tree; visit takes a JournalBranchId and a const JournalBranch&
+    template <typename F>
+    void ForEachBranch(F&& visit) const {
+        for (JournalBranchId id = 0; id < _branches.size(); ++id)
+            if (_branches[id].head != kJournalNil)
+                visit(id, _branches[id]);
+    }
+
+    // makes the tip of a branch current, by way of JumpTo
+    void SwitchToBranch(JournalBranchId id) { JumpTo(_branches[id].tip); }
+
+    // makes node current without running any transactions. This is for
+    // rebuilding a journal's structure, when the application state is
+    // restored by other means.
+    void Seek(JournalIndex node) { _set_current(node); _publish(); }
+
+    // the sink, if any, is told about every append, fork, and merge, and
+    // every node removed or evicted. The journal does not own the sink.
+    void SetSink(JournalSink* sink) { _sink = sink; }
+    JournalSink* Sink() const { return _sink; }
+
+    // limits the memory retained by the journal, and the number of nodes in
+    // it. Zero means no limit. When an append or fork takes the journal over
+    // budget, history is evicted until it is back under seven eighths of the
+    // budget, so that eviction is not paid on every subsequent append.
+    // Branches that do not lead to the current node go first, least recently
+    // visited first; after that, the oldest nodes on the root side of the
+    // current node are dropped, and the root takes the place of the oldest
+    // remaining state. The current node is never evicted.
+    void SetBudget(size_t max_bytes, uint32_t max_nodes);
+
+    // evicts history until the journal is within budget
+    void Trim();
+
+    // drops the oldest step of history, as Trim does once no branches are
+    // left to evict: the root absorbs its only child, and stands for the
+    // state after it. Returns false, changing nothing, if the root or its
+    // child has more than one child. A current child leaves the root current.
+    bool EvictOldest();
+
+    // the bytes retained by a single node: the node itself, its message's
+    // formatter, any closure too large to be stored inline, and whatever its
+    // transaction reports as retained
+    size_t RetainedBytes(JournalIndex node) const;
+
+    // the bytes retained by the whole journal
+    size_t RetainedBytes() const { return _bytes; }
+    uint32_t NodeCount() const { return _nodes.Live(); }
+
+    JournalIndex Root() const { return _root; }
+    JournalIndex Current() const { return _curr; }
+
+    JournalNode& Node(JournalIndex i) { return _nodes[i]; }
+    const JournalNode& Node(JournalIndex i) const { return _nodes[i]; }
 };
 
 
@@ -230,23 +709,211 @@ public:
     virtual bool MustDeactivateUnrelatedModesOnActivation() const { return true; }
 };
 
+// An activity or major mode is identified by the FNV-1a hash of its sname(),
+// which can be computed at compile time, and once registered, by a handle:
+// its index in the manager's registry, stable for the life of the manager.
+// Lookups and activation by handle are O(1) and do not allocate.
+constexpr uint64_t ModeNameId(std::string_view name)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (char c : name)
+        h = (h ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+    return h;
+}
+
+struct ActivityHandle {
+    uint32_t index = UINT32_MAX;
+    explicit operator bool() const { return index != UINT32_MAX; }
+    bool operator==(ActivityHandle h) const { return index == h.index; }
+    bool operator!=(ActivityHandle h) const { return index != h.index; }
+};
+
+struct MajorModeHandle {
+    uint32_t index = UINT32_MAX;
+    explicit operator bool() const { return index != UINT32_MAX; }
+    bool operator==(MajorModeHandle h) const { return index == h.index; }
+    bool operator!=(MajorModeHandle h) const { return index != h.index; }
+};
+
+// a registered activity; instance is null until the activity is first found
+struct ActivityRecord {
+    std::string name;
+    std::shared_ptr<Activity> instance;
+};
+
+// a view of the manager's activity records, in registration order, so that
+// record i is the one for the handle with index i. A span is invalidated by
+// registering an activity.
+class ActivitySpan {
+    const ActivityRecord* _first = nullptr;
+    size_t _count = 0;
+
+public:
+    ActivitySpan() = default;
+    ActivitySpan(const ActivityRecord* first, size_t count) : _first(first), _count(count) {}
+
+    const ActivityRecord* begin() const { return _first; }
+    const ActivityRecord* end() const { return _first + _count; }
+    size_t size() const { return _count; }
+    bool empty() const { return !_count; }
+    const ActivityRecord& operator[](size_t i) const { return _first[i]; }
+    const ActivityRecord& operator[](ActivityHandle h) const { return _first[h.index]; }
+};
+
+// Transactions are queued in lanes. Each frame drains the interactive lane
+// completely, and then at most the background quota from the background
+// lane, so that edits made in the viewport are not held up behind a bulk
+// import. Order is kept within a lane, but not across lanes: a transaction
+// that must follow one in another lane should be enqueued after that one has
+// run.
+enum class TransactionLane : uint8_t {
+    Interactive,
+    Background,
+};
+
+constexpr size_t kTransactionLaneCount = 2;
+
+// What happens to a transaction enqueued while the queue is at capacity.
+// Block waits for the frame thread to make room. FailFast refuses the
+// transaction. DropOldestMergeable folds a transaction with a merge key into
+// an overflow slot for that key, replacing the exec of whatever transaction
+// with the key is already waiting there and keeping its undo, as the journal
+// would; the slot runs once everything queued before it has, or joins the
+// queue ahead of the next transaction its producer enqueues on the lane, so
+// that order within the lane is kept. Transactions without a merge key block. Transactions enqueued on the
+// frame thread, or by a transaction a worker is executing for the frame, are
+// always admitted, since nothing else could make room; before the first
+// frame, the thread that constructed the manager counts as the frame thread.
+enum class TransactionOverflow : uint8_t {
+    Block,
+    DropOldestMergeable,
+    FailFast,
+};
+
+// counters for the transaction queue, cheap enough to leave on in production
+struct TransactionQueueStats {
+    size_t depth = 0;           // queued and not yet drained, across lanes
+    size_t high_water = 0;      // the most ever queued at once, sampled
+                                // once a frame while unbounded
+    uint64_t enqueued = 0;      // ever queued; sample twice for a rate
+    uint64_t rejected = 0;      // refused by FailFast
+    uint64_t coalesced = 0;     // folded into an overflow slot
+    uint64_t blocked = 0;       // enqueues that waited for room
+};
+
+// A TransactionCompletion resolves once its transaction has run on the frame
+// thread and been journaled. The frame thread resolves every completion of a
+// frame together, and wakes waiters at most once per frame, and not at all
+// when nobody is waiting. A transaction that is never drained, for example
+// because its manager was destroyed first, never completes.
+class TransactionCompletion
+{
+    friend class ModeManager;
+    std::shared_ptr<TransactionCompletionState> _state;
+
+public:
+    TransactionCompletion() = default;
+
+    explicit operator bool() const { return _state != nullptr; }
+
+    bool Ready() const;
+    void Wait() const;
+
+    // true if the transaction was refused by a full FailFast queue, in
+    // which case it will never run, and the completion is already ready
+    bool Refused() const;
+
+    // waits at most seconds, and returns whether the transaction completed
+    bool WaitFor(double seconds) const;
+};
+
+// How transactions reached the queue: through EnqueueTransaction, on the
+// thread's implicit producer, or through a TransactionProducer, one at a time
+// or as a batch.
+enum class TransactionSource : uint8_t {
+    Implicit,
+    Producer,
+    ProducerBatch,
+};
+
+// A TransactionTap is shown every transaction as it is enqueued, before it
+// joins a group or the queue, along with the beginning and end of each
+// transaction group. A producer's batch is shown in one call. The calls are
+// made on the enqueuing thread, so a tap must be thread safe, and should be
+// cheap.
+class TransactionTap {
+public:
+    virtual ~TransactionTap() = default;
+
+    virtual void Enqueued(const Transaction* t, size_t count, TransactionLane lane,
+                          TransactionSource source) = 0;
+    virtual void GroupBegan(const TransactionMessage& message, TransactionLane lane) = 0;
+    virtual void GroupEnded() = 0;
+};
+
+// A TransactionProducer enqueues onto a ModeManager's transaction queue
+// through a sub-queue of its own, so that threads that each hold one do not
+// contend on the queue's lookup of the calling thread's implicit producer.
+// A producer may be moved between threads, but may only be used by one thread
+// at a time, and must be destroyed before the ModeManager that made it.
+// Transactions enqueued through a producer go to the lane it was made for, or
+// join an open transaction group on the calling thread, as
+// EnqueueTransaction's do.
+class TransactionProducer
+{
+    friend class ModeManager;
+    struct data;
+    std::unique_ptr<data> _self;
+
+    explicit TransactionProducer(data* self);
+
+public:
+    TransactionProducer();
+    TransactionProducer(TransactionProducer&&) noexcept;
+    TransactionProducer& operator=(TransactionProducer&&) noexcept;
+    ~TransactionProducer();
+
+    explicit operator bool() const { return _self != nullptr; }
+
+    // returns false if the transaction was refused, as EnqueueTransaction
+    bool Enqueue(Transaction&& t);
+
+    // enqueues count transactions, moved from batch, in order. A batch that
+    // would overflow a FailFast queue is refused as a whole.
+    bool Enqueue(Transaction* batch, size_t count);
+};
+
+// how far behind the transaction queue was left at the end of the last frame
+struct TransactionBacklog {
+    size_t interactive = 0;     // approximate count still queued in each lane
+    size_t background = 0;
+    size_t ran = 0;             // transactions run in the last frame
+    double elapsed = 0;         // seconds the last frame spent running them
+    double seconds = 0;         // estimated seconds to run what is queued
+    double frames = 0;          // estimated frames to catch up, given the budget and quota
+};
+
 class ModeManager
 {
+    friend class TransactionProducer;
     struct data;
     data* _self;
     
     Journal _journal;
 
-    std::string _major_mode_pending;
+    MajorModeHandle _major_mode_pending;
 
     // private to prevent assignment
     ModeManager& operator=(const ModeManager&);
     
-    void _activate_major_mode(const std::string& name);
+    void _activate_major_mode(MajorModeHandle mode);
     void _deactivate_major_mode(const std::string& name);
-    void _register_activity(const std::string& name, std::function< std::shared_ptr<Activity>() > fn);
-    void _register_major_mode(const std::string& name, std::function< std::shared_ptr<MajorMode>() > fn);
+    ActivityHandle _register_activity(const std::string& name, std::function< std::shared_ptr<Activity>() > fn);
+    MajorModeHandle _register_major_mode(const std::string& name, std::function< std::shared_ptr<MajorMode>() > fn);
 
+    // activation changes are marked, and applied together at the next
+    // dispatch or frame, so that a run of them patches the active set once
+    void _mark_activity(ActivityHandle h);
     void _set_activities();
 
 public:
@@ -255,48 +922,99 @@ public:
     
     static ModeManager* Canonical();
 
+    // a copy of the activities created so far, by name. ActivityRecords is
+    // the same information without the copy.
     const std::map< std::string, std::shared_ptr<Activity> > Activities() const;
+    ActivitySpan ActivityRecords() const;
+
+    // changes whenever an activity is registered, created, activated or
+    // deactivated, so that data derived from the activities can be cached
+    // until it does
+    uint64_t ActivitiesGeneration() const;
+
     const std::vector<std::string>& ActivityNames() const;
     const std::vector<std::string>& MajorModeNames() const;
 
+    // registration returns the handle for the name, which is the same if the
+    // name is registered again. A name whose id collides with that of a
+    // different name already registered is refused, with an empty handle.
     template <typename ActivityType>
-    void RegisterActivity(std::function< std::shared_ptr<Activity>() > fn)
+    ActivityHandle RegisterActivity(std::function< std::shared_ptr<Activity>() > fn)
     {
-        _register_activity(ActivityType::sname(), fn);
+        return _register_activity(ActivityType::sname(), fn);
     }
 
     template <typename MajorModeType>
-    void RegisterMajorMode(std::function< std::shared_ptr<MajorMode>() > fn)
+    MajorModeHandle RegisterMajorMode(std::function< std::shared_ptr<MajorMode>() > fn)
     {
         static_assert(std::is_base_of<MajorMode, MajorModeType>::value, "must register MajorMode");
-        _register_major_mode(MajorModeType::sname(), fn);
+        return _register_major_mode(MajorModeType::sname(), fn);
     }
 
-    void ActivateMajorMode(const std::string& name) {
-        auto m = FindMode(name);
-        if (m) {
-            _major_mode_pending = name;
+    // handles by id, a ModeNameId; an unregistered id gives an empty handle
+    ActivityHandle FindActivityHandle(uint64_t id) const;
+    MajorModeHandle FindMajorModeHandle(uint64_t id) const;
+
+    template <typename T>
+    ActivityHandle FindActivityHandle() const { return FindActivityHandle(ModeNameId(T::sname())); }
+
+    template <typename T>
+    MajorModeHandle FindMajorModeHandle() const { return FindMajorModeHandle(ModeNameId(T::sname())); }
+
+    void ActivateMajorMode(MajorModeHandle h) {
+        if (FindMode(h)) {
+            _major_mode_pending = h;
         }
     }
 
-    void ActivateActivity(const std::string& name) {
-        auto m = FindActivity(name);
+    void ActivateMajorMode(std::string_view name) {
+        ActivateMajorMode(FindMajorModeHandle(ModeNameId(name)));
+    }
+
+    void ActivateActivity(ActivityHandle h) {
+        Activity* m = FindActivity(h).get();
         if (m) {
             m->Activate();
-            _set_activities();
+            _mark_activity(h);
         }
     }
 
-    void DeactivateActivity(const std::string& name) {
-        auto m = FindActivity(name);
+    void ActivateActivity(std::string_view name) {
+        ActivateActivity(FindActivityHandle(ModeNameId(name)));
+    }
+
+    void DeactivateActivity(ActivityHandle h) {
+        Activity* m = FindActivity(h).get();
         if (m) {
             m->Deactivate();
-            _set_activities();
+            _mark_activity(h);
         }
     }
 
-    std::shared_ptr<Mode> FindMode(const std::string &);
-    std::shared_ptr<Activity> FindActivity(const std::string &);
+    void DeactivateActivity(std::string_view name) {
+        DeactivateActivity(FindActivityHandle(ModeNameId(name)));
+    }
+
+    // changes a set of activities, which, as for a single activity, join or
+    // leave the dispatch tables at the next Run or Update, so these may be
+    // called from an activity's callbacks
+    void ActivateActivities(const ActivityHandle* handles, size_t count);
+    void DeactivateActivities(const ActivityHandle* handles, size_t count);
+    void ActivateActivities(std::initializer_list<ActivityHandle> handles) {
+        ActivateActivities(handles.begin(), handles.size());
+    }
+    void DeactivateActivities(std::initializer_list<ActivityHandle> handles) {
+        DeactivateActivities(handles.begin(), handles.size());
+    }
+
+    // the first lookup of a registered activity or mode creates it; an empty
+    // handle finds nothing. The reference lasts until the next registration,
+    // which activating an activity or mode may make
+    const std::shared_ptr<MajorMode>& FindMode(MajorModeHandle);
+    const std::shared_ptr<Activity>& FindActivity(ActivityHandle);
+
+    std::shared_ptr<Mode> FindMode(std::string_view name);
+    std::shared_ptr<Activity> FindActivity(std::string_view name);
 
     template <typename T>
     std::shared_ptr<T> FindMode()
@@ -307,12 +1025,17 @@ public:
 
     template <typename T>
     std::shared_ptr<T> LockActivity(std::weak_ptr<T>& m) {
+        return LockActivity(FindActivityHandle<T>(), m);
+    }
+
+    template <typename T>
+    std::shared_ptr<T> LockActivity(ActivityHandle h, std::weak_ptr<T>& m) {
         auto r = m.lock();
         if (!r) {
-            auto activity = FindActivity(T::sname());
+            auto& activity = FindActivity(h);
             if (activity) {
                 m = std::dynamic_pointer_cast<T>(activity);
-                r = std::dynamic_pointer_cast<T>(m.lock());
+                r = m.lock();
             }
         }
         return r;
@@ -326,12 +1049,101 @@ public:
     void RunModeRendering(const LabViewInteraction&);
     void RunMainMenu();
         
-    void EnqueueTransaction(Transaction&&);
+    // returns false only if the queue is at capacity with the FailFast
+    // policy, in which case the transaction is destroyed unrun
+    bool EnqueueTransaction(Transaction&&, TransactionLane lane = TransactionLane::Interactive);
     void UpdateTransactionQueueActivationAndModes();
 
+    // attaches a completion to t, which may then be enqueued by any means,
+    // including a producer or a transaction group; a group completes its
+    // members' completions when the group itself completes
+    TransactionCompletion TrackTransaction(Transaction& t);
+
+    // a refused transaction's completion is ready, and reports Refused()
+    TransactionCompletion EnqueueTransactionWithCompletion(
+        Transaction&& t, TransactionLane lane = TransactionLane::Interactive)
+    {
+        TransactionCompletion c = TrackTransaction(t);
+        EnqueueTransaction(std::move(t), lane);
+        return c;
+    }
+
+    // a producer for a thread that enqueues often, such as a loader
+    TransactionProducer MakeTransactionProducer(TransactionLane lane = TransactionLane::Interactive);
+
+    // the most background transactions run in a frame; 1024 by default
+    void SetBackgroundQuota(size_t per_frame);
+
+    // with a non-zero budget, a frame stops running transactions once it has
+    // spent about that many seconds on them, and leaves the rest queued for
+    // the next frame. Transactions are dequeued in slices sized from their
+    // recent average cost, so a frame overshoots by at most a slice that
+    // took longer than expected. At least one slice runs every frame, so the
+    // queue always makes progress. Zero, the default, runs everything queued.
+    void SetTransactionBudget(double seconds);
+    TransactionBacklog Backlog() const;
+
+    // the tap, if any, sees every transaction enqueued. The manager does not
+    // own the tap. It may be set while producers run, but an enqueue under
+    // way may still call a tap that has just been removed, so producers must
+    // be quiesced after removing a tap and before destroying it.
+    void SetTransactionTap(TransactionTap* tap);
+
+    // bounds the number of queued transactions, across lanes; zero, the
+    // default, leaves the queue unbounded. A producer's batch larger than
+    // the capacity is admitted whole once the queue is empty.
+    void SetTransactionCapacity(size_t capacity,
+                                TransactionOverflow policy = TransactionOverflow::Block);
+    TransactionQueueStats QueueStats() const;
+
+    // with a non-zero count, transactions drained in the same frame whose
+    // conflict keys differ are executed across that many worker threads
+    // plus the frame thread. They are journaled in the order they were
+    // dequeued regardless, so the journal is deterministic. Zero, the
+    // default, runs every transaction on the frame thread, as does a journal
+    // taking checkpoints, whose snapshots must see each transaction's state.
+    void SetTransactionWorkers(unsigned count);
+
+    // Transactions enqueued on this thread between BeginTransactionGroup and
+    // EndTransactionGroup are gathered into one batch, with room reserved up
+    // front for reserve of them. When the outermost group ends, the batch is
+    // enqueued as a single transaction that executes its members in order,
+    // undoes them in reverse order, and is journaled as one node. Groups are
+    // per thread, so transactions from other threads are not swept in. The
+    // batch is enqueued in the lane of the outermost group. Ending the
+    // outermost group returns false if the queue refused the batch, in which
+    // case none of its members will run, and their completions are refused.
+    void BeginTransactionGroup(TransactionMessage message, size_t reserve = 16,
+                               TransactionLane lane = TransactionLane::Interactive);
+    bool EndTransactionGroup();
+
     Journal& Journal() { return _journal; }
 };
 
+// holds a transaction group open for the lifetime of the scope
+class TransactionGroupScope
+{
+    ModeManager& _mm;
+    bool _open = true;
+
+public:
+    TransactionGroupScope(ModeManager& mm, TransactionMessage message, size_t reserve = 16,
+                          TransactionLane lane = TransactionLane::Interactive)
+        : _mm(mm) { _mm.BeginTransactionGroup(std::move(message), reserve, lane); }
+    ~TransactionGroupScope() { End(); }
+
+    // ends the group before the scope does, to learn whether it was refused
+    bool End() {
+        if (!_open)
+            return true;
+        _open = false;
+        return _mm.EndTransactionGroup();
+    }
+
+    TransactionGroupScope(const TransactionGroupScope&) = delete;
+    TransactionGroupScope& operator=(const TransactionGroupScope&) = delete;
+};
+
 } // lab
 
 #endif //__cplusplus
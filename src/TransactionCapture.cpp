@@ -0,0 +1,286 @@
+//
+//  TransactionCapture.cpp
+//  LabExcelsior
+//
+//  Copyright © 2023. All rights reserved.
+//
+
+#include "TransactionCapture.h"
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <string.h>
+#include <thread>
+
+namespace lab {
+
+namespace {
+
+enum RecordKind : uint32_t {
+    kRecordTransaction = 1,     // through EnqueueTransaction
+    kRecordGroupBegin = 2,
+    kRecordGroupEnd = 3,
+    kRecordProduced = 4,        // through a TransactionProducer
+    kRecordBatch = 5,           // a producer's batch; the payload is the
+                                // count of produced records that follow
+};
+
+struct RecordHeader {
+    uint32_t kind;
+    uint32_t size;      // payload bytes following the header
+    int64_t time;       // nanoseconds since the capture was opened
+    uint32_t thread;
+    uint32_t lane;
+};
+
+const char kMagic[8] = { 'L', 'A', 'B', 'T', 'C', 'A', 'P', '1' };
+const size_t kBufferBytes = 64 * 1024;
+
+std::atomic<uint64_t> gSerial { 1 };
+
+// the buffer the current thread last recorded into, and the capture it
+// belongs to. Captures are told apart by serial rather than address, since
+// a new capture may reuse the address of a destroyed one.
+struct BufferCache {
+    uint64_t serial = 0;
+    void* buffer = nullptr;
+};
+thread_local BufferCache tBuffer;
+
+int64_t Now()
+{
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+} // anon
+
+TransactionCapture::TransactionCapture(TransactionWriter write)
+    : _write(std::move(write))
+    , _serial(gSerial.fetch_add(1))
+{
+}
+
+TransactionCapture::~TransactionCapture()
+{
+    Close();
+}
+
+bool TransactionCapture::Open(const std::string& path)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    if (_file)
+        return false;
+    _file = fopen(path.c_str(), "wb");
+    if (!_file)
+        return false;
+    if (fwrite(kMagic, sizeof(kMagic), 1, _file) != 1) {
+        fclose(_file);
+        _file = nullptr;
+        return false;
+    }
+    _start = Now();
+    return true;
+}
+
+void TransactionCapture::Close()
+{
+    std::vector<Buffer*> buffers;
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        for (auto& b : _buffers)
+            buffers.push_back(b.get());
+    }
+    for (Buffer* b : buffers) {
+        std::lock_guard<std::mutex> lock(b->lock);
+        _write_out(b->bytes);
+    }
+
+    std::lock_guard<std::mutex> lock(_lock);
+    if (_file) {
+        fclose(_file);
+        _file = nullptr;
+    }
+}
+
+TransactionCapture::Buffer* TransactionCapture::_buffer()
+{
+    if (tBuffer.serial == _serial)
+        return static_cast<Buffer*>(tBuffer.buffer);
+
+    std::lock_guard<std::mutex> lock(_lock);
+    _buffers.emplace_back(new Buffer);
+    Buffer* b = _buffers.back().get();
+    b->thread = static_cast<uint32_t>(_buffers.size() - 1);
+    b->bytes.reserve(kBufferBytes);
+    tBuffer.serial = _serial;
+    tBuffer.buffer = b;
+    return b;
+}
+
+// called with the buffer's lock held
+void TransactionCapture::_write_out(std::string& bytes)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    if (_file && !bytes.empty())
+        fwrite(bytes.data(), 1, bytes.size(), _file);
+    bytes.clear();
+}
+
+void TransactionCapture::_record(uint32_t kind, TransactionLane lane, const char* payload, size_t size)
+{
+    Buffer* b = _buffer();
+
+    RecordHeader h = {};
+    h.kind = kind;
+    h.size = static_cast<uint32_t>(size);
+    h.time = Now() - _start;
+    h.thread = b->thread;
+    h.lane = static_cast<uint32_t>(lane);
+
+    std::lock_guard<std::mutex> lock(b->lock);
+    b->bytes.append(reinterpret_cast<const char*>(&h), sizeof(h));
+    b->bytes.append(payload, size);
+    if (b->bytes.size() >= kBufferBytes)
+        _write_out(b->bytes);
+}
+
+void TransactionCapture::Enqueued(const Transaction* t, size_t count, TransactionLane lane,
+                                  TransactionSource source)
+{
+    if (source == TransactionSource::ProducerBatch) {
+        uint32_t n = static_cast<uint32_t>(count);
+        _record(kRecordBatch, lane, reinterpret_cast<const char*>(&n), sizeof(n));
+    }
+
+    // a transaction the writer cannot encode is still recorded, so that the
+    // replayed traffic keeps its shape
+    uint32_t kind = source == TransactionSource::Implicit ? kRecordTransaction : kRecordProduced;
+    thread_local std::string scratch;
+    for (size_t i = 0; i < count; ++i) {
+        scratch.clear();
+        if (!_write || !_write(t[i], scratch))
+            scratch.clear();
+        _record(kind, lane, scratch.data(), scratch.size());
+    }
+}
+
+void TransactionCapture::GroupBegan(const TransactionMessage& message, TransactionLane lane)
+{
+    std::string text = message.Str();
+    _record(kRecordGroupBegin, lane, text.data(), text.size());
+}
+
+void TransactionCapture::GroupEnded()
+{
+    _record(kRecordGroupEnd, TransactionLane::Interactive, nullptr, 0);
+}
+
+size_t TransactionCapture::Replay(const std::string& path, ModeManager& mm,
+                                  const TransactionReader& read, double speed)
+{
+    std::string bytes;
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f)
+        return 0;
+    char chunk[64 * 1024];
+    for (size_t n; (n = fread(chunk, 1, sizeof(chunk), f)) > 0; )
+        bytes.append(chunk, n);
+    fclose(f);
+    if (bytes.size() < sizeof(kMagic) || memcmp(bytes.data(), kMagic, sizeof(kMagic)) != 0)
+        return 0;
+
+    // each thread's records, in order; parsing stops at a truncated record
+    std::map<uint32_t, std::vector<size_t>> threads;
+    size_t offset = sizeof(kMagic);
+    while (offset + sizeof(RecordHeader) <= bytes.size()) {
+        RecordHeader h;
+        memcpy(&h, bytes.data() + offset, sizeof(h));
+        if (h.kind < kRecordTransaction || h.kind > kRecordBatch)
+            break;
+        if (h.size > bytes.size() - offset - sizeof(h))
+            break;
+        threads[h.thread].push_back(offset);
+        offset += sizeof(h) + h.size;
+    }
+
+    std::atomic<size_t> enqueued { 0 };
+    auto start = std::chrono::steady_clock::now();
+    auto header = [&bytes](size_t r) {
+        RecordHeader h;
+        memcpy(&h, bytes.data() + r, sizeof(h));
+        return h;
+    };
+    auto replay = [&](const std::vector<size_t>& records) {
+        TransactionProducer producers[kTransactionLaneCount];
+        auto producer = [&](size_t l) -> TransactionProducer& {
+            if (!producers[l])
+                producers[l] = mm.MakeTransactionProducer(static_cast<TransactionLane>(l));
+            return producers[l];
+        };
+        std::vector<Transaction> batch;
+        for (size_t i = 0; i < records.size(); ++i) {
+            RecordHeader h = header(records[i]);
+            const char* payload = bytes.data() + records[i] + sizeof(h);
+            size_t l = h.lane < kTransactionLaneCount ? h.lane : 0;
+            TransactionLane lane = static_cast<TransactionLane>(l);
+            if (speed > 0)
+                std::this_thread::sleep_until(start + std::chrono::nanoseconds(int64_t(h.time / speed)));
+
+            switch (h.kind) {
+                case kRecordTransaction: {
+                    Transaction t;
+                    if (!read || !read(payload, h.size, t))
+                        break;
+                    if (mm.EnqueueTransaction(std::move(t), lane))
+                        enqueued.fetch_add(1, std::memory_order_relaxed);
+                    break;
+                }
+                case kRecordProduced: {
+                    Transaction t;
+                    if (!read || !read(payload, h.size, t))
+                        break;
+                    if (producer(l).Enqueue(std::move(t)))
+                        enqueued.fetch_add(1, std::memory_order_relaxed);
+                    break;
+                }
+                case kRecordBatch: {
+                    // the members follow the marker; a truncated batch is
+                    // enqueued as far as it goes
+                    uint32_t count = 0;
+                    if (h.size >= sizeof(count))
+                        memcpy(&count, payload, sizeof(count));
+                    batch.clear();
+                    for (; count && i + 1 < records.size(); --count) {
+                        RecordHeader m = header(records[i + 1]);
+                        if (m.kind != kRecordProduced)
+                            break;
+                        ++i;
+                        Transaction t;
+                        if (read && read(bytes.data() + records[i] + sizeof(m), m.size, t))
+                            batch.push_back(std::move(t));
+                    }
+                    if (!batch.empty() && producer(l).Enqueue(batch.data(), batch.size()))
+                        enqueued.fetch_add(batch.size(), std::memory_order_relaxed);
+                    break;
+                }
+                case kRecordGroupBegin:
+                    mm.BeginTransactionGroup(std::string(payload, h.size), 16, lane);
+                    break;
+                case kRecordGroupEnd:
+                    mm.EndTransactionGroup();
+                    break;
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (auto& t : threads)
+        workers.emplace_back(replay, std::cref(t.second));
+    for (auto& w : workers)
+        w.join();
+    return enqueued.load();
+}
+
+} // lab
@@ -0,0 +1,94 @@
+//
+//  TransactionCapture.h
+//  LabExcelsior
+//
+//  Copyright © 2023. All rights reserved.
+//
+
+/*
+ TransactionCapture records every transaction enqueued on a ModeManager to
+ a compact binary file. Each record carries the time since the capture was
+ opened, the producer thread, the lane, whether the transaction came through
+ EnqueueTransaction or a TransactionProducer, and the payload produced by the
+ application's TransactionWriter. A producer's batch is recorded as a marker
+ followed by its members, and transaction groups as begin and end markers on
+ their thread.
+
+ Replay feeds a capture back through a ModeManager's queue, each transaction
+ through the entry point it was recorded from, and each batch as one batch.
+ Each recorded producer thread gets a thread of its own, so the contention
+ the drain saw is reproduced along with the traffic, and the records are
+ enqueued either at their recorded times, scaled by a speed, or as fast as
+ possible.
+
+ Recording appends to a buffer per producer thread, and only takes a shared
+ lock to write a full buffer to the file, so capturing adds little to the
+ enqueue path. Records within a thread are in order; across threads they are
+ ordered by their timestamps.
+ */
+
+#ifndef TransactionCapture_h
+#define TransactionCapture_h
+
+#include "Modes.h"
+
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+
+namespace lab {
+
+class TransactionCapture : public TransactionTap
+{
+    struct Buffer {
+        std::mutex lock;
+        uint32_t thread;
+        std::string bytes;
+    };
+
+    TransactionWriter _write;
+    uint64_t _serial;
+    int64_t _start = 0;
+
+    std::mutex _lock;
+    FILE* _file = nullptr;
+    std::vector<std::unique_ptr<Buffer>> _buffers;     // guarded by _lock
+
+    Buffer* _buffer();
+    void _record(uint32_t kind, TransactionLane lane, const char* payload, size_t size);
+    void _write_out(std::string& bytes);
+
+public:
+    explicit TransactionCapture(TransactionWriter write);
+    ~TransactionCapture();
+
+    TransactionCapture(const TransactionCapture&) = delete;
+    TransactionCapture& operator=(const TransactionCapture&) = delete;
+
+    // starts a capture at path, replacing any file there
+    bool Open(const std::string& path);
+
+    // writes out every thread's buffered records and closes the file. The
+    // capture should be removed from the ModeManager, and the producers
+    // quiesced, first.
+    void Close();
+
+    void Enqueued(const Transaction* t, size_t count, TransactionLane lane,
+                  TransactionSource source) override;
+    void GroupBegan(const TransactionMessage& message, TransactionLane lane) override;
+    void GroupEnded() override;
+
+    // enqueues the transactions captured at path on mm, from a thread per
+    // recorded producer thread, with a TransactionProducer per lane for those
+    // recorded from one, and returns how many were enqueued, or zero if the
+    // capture cannot be read. With a speed of zero, records are enqueued as
+    // fast as possible; otherwise at their recorded times divided by speed.
+    // Replay returns once everything is enqueued, so the frame thread must
+    // keep draining meanwhile. A record the reader rejects is skipped.
+    static size_t Replay(const std::string& path, ModeManager& mm,
+                         const TransactionReader& read, double speed = 1);
+};
+
+} // lab
+
+#endif /* TransactionCapture_h */
@@ -0,0 +1,244 @@
+//
+//  TransactionRing.h
+//  LabExcelsior
+//
+//  Copyright © 2023. All rights reserved.
+//
+
+/*
+ TransactionRing is a multiple producer, single consumer queue for the
+ ModeManager's transactions, and can stand in for moodycamel's
+ ConcurrentQueue, whose interface it mirrors as far as the ModeManager uses
+ it. Define LAB_TRANSACTION_QUEUE_MPSC to build the ModeManager with it.
+
+ Items are constructed in place in a fixed ring of slots, each carrying a
+ sequence number that says whether it is free or full for the current lap.
+ Producers claim slots by advancing the tail with a compare and swap, and
+ a bulk enqueue claims all of its slots at once. The single consumer needs
+ no atomic read-modify-write at all. The tail and the head sit on cache lines
+ of their own, so producers hammering the tail do not slow the consumer.
+
+ A producer that finds the ring full spills into a locked overflow list
+ rather than waiting, so that enqueuing from the consumer's own thread
+ cannot deadlock. Each spilled item notes the tail at the time, and the
+ consumer takes it once the head reaches that point, ahead of the slots
+ claimed after it. Any later item from the same producer is in one of those
+ slots or further down the spill, so a producer can try the ring again on
+ every enqueue and still have its transactions taken in order, and spilled
+ items are not starved by producers that keep the ring busy.
+ */
+
+#ifndef TransactionRing_h
+#define TransactionRing_h
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <utility>
+
+#ifndef LAB_TRANSACTION_RING_CAPACITY
+#define LAB_TRANSACTION_RING_CAPACITY 1024
+#endif
+
+namespace lab {
+
+template <typename T, size_t Capacity = LAB_TRANSACTION_RING_CAPACITY>
+class TransactionRing
+{
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0,
+                  "capacity must be a power of two");
+
+    static constexpr size_t kMask = Capacity - 1;
+    static constexpr size_t kCacheLine = 64;
+    static constexpr size_t kNone = ~size_t(0);
+
+    struct Slot {
+        std::atomic<size_t> sequence;
+        alignas(T) unsigned char storage[sizeof(T)];
+
+        T* item() { return std::launder(reinterpret_cast<T*>(storage)); }
+    };
+
+    struct Spilled {
+        size_t after;       // the tail when the item was spilled
+        T item;
+    };
+
+    Slot* _slots;
+
+    alignas(kCacheLine) std::atomic<size_t> _tail { 0 };
+    alignas(kCacheLine) std::atomic<size_t> _head { 0 };   // written by the consumer only
+
+    alignas(kCacheLine) std::atomic<size_t> _spill_front { kNone };   // the front item's after
+    std::atomic<size_t> _spill_pushed { 0 };    // items ever spilled
+    std::atomic<size_t> _spill_taken { 0 };     // items ever taken from the spill
+    std::mutex _spill_lock;
+    std::deque<Spilled> _spill;
+
+    template <typename It>
+    void _spill_items(It it, size_t count)
+    {
+        std::lock_guard<std::mutex> lock(_spill_lock);
+        // every slot the producer claimed before is below the tail, and
+        // every one it claims later is at or above it
+        size_t after = _tail.load();
+        bool was_empty = _spill.empty();
+        for (size_t i = 0; i < count; ++i, ++it)
+            _spill.push_back({ after, std::move(*it) });
+        if (was_empty)
+            _spill_front.store(after);
+        _spill_pushed.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    // claims count consecutive slots, returning the first position, or
+    // returns false if the ring has no room for them
+    bool _claim(size_t count, size_t& pos)
+    {
+        pos = _tail.load(std::memory_order_relaxed);
+        for (;;) {
+            // the consumer frees slots in order, so if the last slot wanted
+            // is free for this lap, so are the ones before it
+            size_t last = pos + count - 1;
+            size_t seq = _slots[last & kMask].sequence.load(std::memory_order_acquire);
+            ptrdiff_t lap = static_cast<ptrdiff_t>(seq - last);
+            if (lap == 0) {
+                if (_tail.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed))
+                    return true;
+            }
+            else if (lap < 0)
+                return false;
+            else
+                pos = _tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    // puts count items in the ring, or spills them all, in order
+    template <typename It>
+    void _enqueue(It it, size_t count)
+    {
+        size_t pos;
+        if (count > Capacity || !_claim(count, pos)) {
+            _spill_items(it, count);
+            return;
+        }
+        for (size_t i = 0; i < count; ++i, ++it) {
+            Slot& s = _slots[(pos + i) & kMask];
+            ::new (static_cast<void*>(s.storage)) T(std::move(*it));
+            s.sequence.store(pos + i + 1, std::memory_order_release);
+        }
+    }
+
+public:
+    // the ModeManager asks for tokens, which the ring does not need
+    struct producer_token_t { explicit producer_token_t(TransactionRing&) {} };
+    struct consumer_token_t { explicit consumer_token_t(TransactionRing&) {} };
+
+    TransactionRing()
+        : _slots(static_cast<Slot*>(::operator new(sizeof(Slot) * Capacity)))
+    {
+        for (size_t i = 0; i < Capacity; ++i)
+            ::new (&_slots[i].sequence) std::atomic<size_t>(i);
+    }
+
+    ~TransactionRing()
+    {
+        size_t tail = _tail.load(std::memory_order_relaxed);
+        for (size_t i = _head.load(std::memory_order_relaxed); i != tail; ++i)
+            _slots[i & kMask].item()->~T();
+        ::operator delete(_slots);
+    }
+
+    TransactionRing(const TransactionRing&) = delete;
+    TransactionRing& operator=(const TransactionRing&) = delete;
+
+    bool enqueue(T&& t)
+    {
+        _enqueue(&t, 1);
+        return true;
+    }
+
+    bool enqueue(const producer_token_t&, T&& t) { return enqueue(std::move(t)); }
+
+    template <typename It>
+    bool enqueue_bulk(It it, size_t count)
+    {
+        if (count)
+            _enqueue(it, count);
+        return true;
+    }
+
+    template <typename It>
+    bool enqueue_bulk(const producer_token_t&, It it, size_t count)
+    {
+        return enqueue_bulk(it, count);
+    }
+
+    // moves up to max items to out, which are assigned to, and returns how
+    // many were moved. Only one thread may dequeue.
+    template <typename It>
+    size_t try_dequeue_bulk(It out, size_t max)
+    {
+        size_t n = 0;
+        size_t head = _head.load(std::memory_order_relaxed);
+        while (n < max) {
+            Slot& s = _slots[head & kMask];
+            bool ready = s.sequence.load(std::memory_order_acquire) == head + 1;
+
+            // a spilled item goes before the slots claimed after it spilled.
+            // The front is read after the slot, so that anything its
+            // producer spilled before filling it is seen
+            if (_spill_front.load() <= head) {
+                std::lock_guard<std::mutex> lock(_spill_lock);
+                size_t taken = 0;
+                while (n < max && !_spill.empty() && _spill.front().after <= head) {
+                    *out = std::move(_spill.front().item);
+                    ++out;
+                    _spill.pop_front();
+                    ++taken;
+                    ++n;
+                }
+                _spill_front.store(_spill.empty() ? kNone : _spill.front().after);
+                _spill_taken.fetch_add(taken, std::memory_order_relaxed);
+                continue;
+            }
+            if (!ready)
+                break;
+            T* item = s.item();
+            *out = std::move(*item);
+            ++out;
+            item->~T();
+            s.sequence.store(head + Capacity, std::memory_order_release);
+            ++head;
+            ++n;
+        }
+        _head.store(head, std::memory_order_relaxed);
+        return n;
+    }
+
+    template <typename It>
+    size_t try_dequeue_bulk(consumer_token_t&, It out, size_t max)
+    {
+        return try_dequeue_bulk(out, max);
+    }
+
+    bool try_dequeue(T& t) { return try_dequeue_bulk(&t, 1) == 1; }
+    bool try_dequeue(consumer_token_t&, T& t) { return try_dequeue(t); }
+
+    size_t size_approx() const
+    {
+        size_t tail = _tail.load(std::memory_order_relaxed);
+        size_t head = _head.load(std::memory_order_relaxed);
+        size_t taken = _spill_taken.load(std::memory_order_relaxed);
+        size_t pushed = _spill_pushed.load(std::memory_order_relaxed);
+        return (tail > head ? tail - head : 0) + (pushed > taken ? pushed - taken : 0);
+    }
+
+    // how many items have ever gone through the spill rather than the ring
+    size_t spill_count() const { return _spill_pushed.load(std::memory_order_relaxed); }
+};
+
+} // lab
+
+#endif /* TransactionRing_h */